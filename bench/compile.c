@@ -0,0 +1,190 @@
+// compile is a benchmark of the whole compiler. It generates synthetic programs which stress
+// different parts of it, compiles each of them in a child process, and reports the throughput
+// of tokenize() in tokens/s, of program() in nodes/s and of code generation in output bytes/s.
+// `make bench` appends the results to bench/results.log, so that a regression shows up as a
+// number which can be compared with the earlier ones.
+//
+//   make bench
+//   bench/compile [label] [scale]
+#define _DEFAULT_SOURCE
+#define main n9cc_main
+#include "../main.c"
+#undef main
+
+#include <sys/wait.h>
+
+// Source is a growable string holding a generated program.
+typedef struct {
+	char *buf;
+	size_t len;
+	size_t cap;
+} Source;
+
+void put(Source *src, char *fmt, ...) {
+	for (;;) {
+		va_list ap;
+		va_start(ap, fmt);
+		int n = vsnprintf(src->buf + src->len, src->cap - src->len, fmt, ap);
+		va_end(ap);
+		if (src->len + n < src->cap) {
+			src->len += n;
+			return;
+		}
+		src->cap = src->cap ? src->cap * 2 : 1 << 20;
+		src->buf = realloc(src->buf, src->cap);
+	}
+}
+
+// gen_deep_expr generates functions returning deeply nested expressions, which stress the
+// recursion of the parser and the register allocation of -O1.
+void gen_deep_expr(Source *src, int scale) {
+	char *ops = "+-*+";
+	for (int f = 0; f < 200 * scale; f++) {
+		put(src, "int f%d(int a, int b) { return ", f);
+		for (int d = 0; d < 200; d++) {
+			put(src, "%c %c (", d % 2 ? 'a' : 'b', ops[d % 4]);
+		}
+		put(src, "a");
+		for (int d = 0; d < 200; d++) {
+			put(src, ")");
+		}
+		put(src, "; }\n");
+	}
+}
+
+// gen_many_locals generates functions with many local variables, which stress find_lvar().
+void gen_many_locals(Source *src, int scale) {
+	for (int f = 0; f < 10 * scale; f++) {
+		put(src, "int f%d(int a) { int v0; v0 = a;", f);
+		for (int i = 1; i < 1000; i++) {
+			put(src, " int v%d; v%d = v%d + %d;", i, i, i - 1, i);
+		}
+		put(src, " return v999; }\n");
+	}
+}
+
+// gen_many_funcs generates many small functions calling each other.
+void gen_many_funcs(Source *src, int scale) {
+	put(src, "int f0(int a, int b) { return a + b; }\n");
+	for (int f = 1; f < 10000 * scale; f++) {
+		put(src, "int f%d(int a, int b) { int c; c = a * %d + b; if (c > 100) return c - f%d(a, b); return c; }\n",
+			f, f % 97, f - 1);
+	}
+}
+
+// gen_long_loop generates functions with loops of long bodies.
+void gen_long_loop(Source *src, int scale) {
+	for (int f = 0; f < 2 * scale; f++) {
+		put(src, "int f%d(int n) { int i; int s; s = 0; for (i = 0; i < n; i = i + 1) {", f);
+		for (int i = 0; i < 5000; i++) {
+			put(src, " s = s + i * %d; if (s > %d) s = s - n;", i % 13, 1000 + i);
+		}
+		put(src, " } return s; }\n");
+	}
+}
+
+typedef struct {
+	char *name;
+	void (*gen)(Source *src, int scale);
+} Workload;
+
+Workload workloads[] = {
+	{"deep-expr", gen_deep_expr},
+	{"many-locals", gen_many_locals},
+	{"many-funcs", gen_many_funcs},
+	{"long-loop", gen_long_loop},
+};
+
+// Result is what a child process measures while compiling a program.
+typedef struct {
+	long tokens;
+	long nodes;
+	size_t output_bytes;
+	double tokenize;
+	double program;
+	double gen;
+	double total;
+} Result;
+
+// compile compiles the program at path with opt in a child process. The assembly goes to
+// /dev/null, and the child sends the numbers of --stats back through a pipe.
+Result compile(char *path, char *opt) {
+	int fds[2];
+	if (pipe(fds)) {
+		perror("pipe");
+		exit(1);
+	}
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		int devnull = open("/dev/null", O_WRONLY);
+		dup2(devnull, STDOUT_FILENO);
+		char *argv[] = {"n9cc", opt, path, NULL};
+		n9cc_main(3, argv);
+
+		Result r = {tokens.len, num_nodes - 1, phases[PH_EMIT].bytes,
+					phases[PH_TOKENIZE].wall, phases[PH_PROGRAM].wall, phases[PH_GEN].wall};
+		for (int i = 0; i < NUM_PHASES; i++) {
+			r.total += phases[i].wall;
+		}
+		write(fds[1], &r, sizeof(r));
+		_exit(0);
+	}
+
+	close(fds[1]);
+	Result r;
+	ssize_t n = read(fds[0], &r, sizeof(r));
+	close(fds[0]);
+	int status;
+	waitpid(pid, &status, 0);
+	if (n != sizeof(r) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "bench: compiling %s with %s failed\n", path, opt);
+		exit(1);
+	}
+	return r;
+}
+
+int main(int argc, char **argv) {
+	char *label = argc > 1 ? argv[1] : "-";
+	int scale = argc > 2 ? atoi(argv[2]) : 4;
+	int iterations = 3;
+	char *opts[] = {"-O0", "-O1"};
+
+	char date[32];
+	time_t t = time(NULL);
+	strftime(date, sizeof(date), "%Y-%m-%d", localtime(&t));
+
+	for (int w = 0; w < sizeof(workloads) / sizeof(Workload); w++) {
+		Source src = {0};
+		workloads[w].gen(&src, scale);
+		put(&src, "int main() { return 0; }\n");
+
+		char path[] = "/tmp/n9cc-bench-XXXXXX";
+		int fd = mkstemp(path);
+		if (fd < 0 || write(fd, src.buf, src.len) != (ssize_t)src.len) {
+			fprintf(stderr, "bench: cannot write %s\n", path);
+			exit(1);
+		}
+		close(fd);
+		free(src.buf);
+
+		for (int o = 0; o < 2; o++) {
+			Result best;
+			for (int i = 0; i < iterations; i++) {
+				Result r = compile(path, opts[o]);
+				if (i == 0 || r.total < best.total) {
+					best = r;
+				}
+			}
+			printf("%s %s %-11s %s: %7.3f Mtokens %7.1f Mtokens/s | %7.3f Mnodes %7.1f Mnodes/s | "
+				   "%8.3f MB out %7.1f MB/s | %8.1f ms\n",
+				   date, label, workloads[w].name, opts[o],
+				   best.tokens / 1e6, best.tokens / best.tokenize / 1e6,
+				   best.nodes / 1e6, best.nodes / best.program / 1e6,
+				   best.output_bytes / 1e6, best.output_bytes / best.gen / 1e6,
+				   best.total * 1e3);
+		}
+		unlink(path);
+	}
+	return 0;
+}
@@ -0,0 +1,71 @@
+// lex is a microbenchmark of tokenize(). It generates a source of the given size
+// (8 MiB by default) and reports the throughput of tokenizing it with each implementation of
+// skip_class the CPU supports.
+//
+//   make bench-lex
+//   bench/lex [bytes] [iterations]
+#define _POSIX_C_SOURCE 200809L
+#define main n9cc_main
+#include "../main.c"
+#undef main
+
+#include <time.h>
+
+// snippet is repeated to make the input. It mixes keywords with identifiers that share
+// prefixes with them, numbers and operators.
+char *snippet =
+	"int func(int interval, int *formula) {\n"
+	"  int iffy; int returned; int elsewhere; int whilst; int breakfast;\n"
+	"  iffy = interval * 3 + 42; returned = iffy - *formula / 7;\n"
+	"  if (iffy >= returned) return iffy; else elsewhere = 100;\n"
+	"  while (whilst != 10) { whilst = whilst + 1; if (whilst == 5) break; }\n"
+	"  for (breakfast = 0; breakfast <= 1000; breakfast = breakfast + 1) returned = returned + breakfast;\n"
+	"  return add2(returned, elsewhere) + foo(&iffy, 123456789);\n"
+	"}\n";
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+	size_t size = argc > 1 ? atol(argv[1]) : 8 << 20;
+	int iterations = argc > 2 ? atoi(argv[2]) : 5;
+
+	size_t len = strlen(snippet);
+	char *input = calloc(size + len + INPUT_PADDING, 1);
+	size_t n = 0;
+	while (n < size) {
+		memcpy(input + n, snippet, len);
+		n += len;
+	}
+	user_input = input;
+	user_input_end = input + n;
+
+	// Measure each implementation of skip_class the CPU supports.
+	for (LexerKind kind = LEX_SCALAR; kind <= LEX_AVX2; kind++) {
+		lexer_kind = kind;
+		init_lexer();
+		if (lexer_kind != kind) {
+			continue;
+		}
+
+		double best = 0;
+		long num_tokens = 0;
+		for (int i = 0; i < iterations; i++) {
+			double start = now();
+			tokenize();
+			double elapsed = now() - start;
+
+			num_tokens = tokens.len;
+			if (i == 0 || elapsed < best) {
+				best = elapsed;
+			}
+		}
+
+		printf("lex[%s]: %zu bytes, %ld tokens, %.3f ms, %.1f Mtokens/s, %.1f MB/s\n", lexer_names[kind],
+			   n, num_tokens, best * 1e3, num_tokens / best / 1e6, n / best / 1e6);
+	}
+	return 0;
+}
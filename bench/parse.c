@@ -0,0 +1,62 @@
+// parse is a microbenchmark of program(). It generates an expression-heavy source of the given
+// size (8 MiB by default), tokenizes it once and reports the throughput of parsing it.
+//
+//   make bench-parse
+//   bench/parse [bytes] [iterations]
+#define _POSIX_C_SOURCE 200809L
+#define main n9cc_main
+#include "../main.c"
+#undef main
+
+#include <time.h>
+
+// body is the body of each generated function. It mixes all precedence levels, left- and
+// right-associative operators, unary operators and parentheses, and has few statements so that
+// most of the time goes to expressions.
+char *body =
+	"{ int x; int y;"
+	" x = y = a * 3 + b / (c - 1) * -a - +b;"
+	" y = a + b * c - d / 2 + (a - b) * (c + d) - a * b * c * d + 7 * -c;"
+	" if (a + b * c <= x - 4 * (b + c) == (y > a * 2) != (d >= c - 1)) x = x * y + *&y;"
+	" return x * (y + a) - b / (c + d * (a - 1)) + (x < y) + (a == b) * c - (d != a) / 3; }\n";
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+	size_t size = argc > 1 ? atol(argv[1]) : 8 << 20;
+	int iterations = argc > 2 ? atoi(argv[2]) : 5;
+
+	size_t cap = size + 4096;
+	char *input = calloc(cap + INPUT_PADDING, 1);
+	size_t n = 0;
+	for (int f = 0; n < size; f++) {
+		n += snprintf(input + n, cap - n, "int f%d(int a, int b, int c, int d) %s", f, body);
+	}
+	user_input = input;
+	user_input_end = input + n;
+	tokenize();
+
+	double best = 0;
+	for (int i = 0; i < iterations; i++) {
+		// Start over with empty pools. The symbols are kept, as the tokens refer to the interned names.
+		token = 0;
+		num_nodes = 1;
+		num_node_lists = 0;
+		num_code = 0;
+
+		double start = now();
+		program();
+		double elapsed = now() - start;
+		if (i == 0 || elapsed < best) {
+			best = elapsed;
+		}
+	}
+
+	printf("parse: %zu bytes, %d tokens, %d nodes, %.3f ms, %.1f Mtokens/s, %.1f Mnodes/s\n",
+		   n, tokens.len, num_nodes - 1, best * 1e3, tokens.len / best / 1e6, (num_nodes - 1) / best / 1e6);
+	return 0;
+}
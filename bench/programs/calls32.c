@@ -0,0 +1,15 @@
+int chain(int a, int b) {
+	return add3(add2(a, id(b)), id(a), add2(b, 1));
+}
+
+int main() {
+	int s;
+	int i;
+	s = 0;
+	for (i = 0; i < 10000000; i = i + 1) {
+		s = add2(s, chain(i, 3) - add4(i, i, 3, 3));
+	}
+	if (s == 10000000)
+		return 42;
+	return 1;
+}
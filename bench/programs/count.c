@@ -0,0 +1,19 @@
+int count(int n, int step) {
+	int c;
+	int i;
+	int j;
+	c = 0;
+	for (i = 0; i < n; i = i + 1) {
+		j = 0;
+		while (j < 10000)
+			j = j + step;
+		c = c + j;
+	}
+	return c;
+}
+
+int main() {
+	if (count(30000, id(1)) == 300000000)
+		return 42;
+	return 1;
+}
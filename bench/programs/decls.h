@@ -0,0 +1,11 @@
+// decls.h declares the functions the benchmark programs call, for cc. n9cc doesn't need
+// declarations, and cc would otherwise assume they return a 32-bit int. The programs are
+// compiled by cc with -Dint=long to match n9cc, whose int is 64 bits wide.
+int ret42();
+int id(int v);
+int add2(int a, int b);
+int add3(int a, int b, int c);
+int add4(int a, int b, int c, int d);
+int add5(int a, int b, int c, int d, int e);
+int add6(int a, int b, int c, int d, int e, int f);
+int *makelist(int n);
@@ -0,0 +1,29 @@
+int walk(int *p) {
+	int n;
+	n = 0;
+	while (p) {
+		n = n + 1;
+		p = *p;
+	}
+	return n;
+}
+
+int build(int n, int *next) {
+	int node;
+	int s;
+	int i;
+	node = next;
+	if (n > 1)
+		return build(n - 1, &node);
+	s = 0;
+	for (i = 0; i < 2000; i = i + 1) {
+		s = s + walk(&node);
+	}
+	return s;
+}
+
+int main() {
+	if (build(50000, 0) == 100000000)
+		return 42;
+	return 1;
+}
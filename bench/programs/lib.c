@@ -0,0 +1,13 @@
+// lib.c provides data structures to the benchmark programs, which can't allocate memory
+// themselves. It is compiled by cc, and its long is n9cc's int.
+#include <stdlib.h>
+
+// makelist returns a linked list of n nodes laid out in an array. Each node is a pointer
+// to the next one.
+long *makelist(long n) {
+	long **nodes = calloc(n, sizeof(long *));
+	for (long i = 0; i + 1 < n; i++) {
+		nodes[i] = (long *)&nodes[i + 1];
+	}
+	return (long *)nodes;
+}
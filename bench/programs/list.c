@@ -0,0 +1,23 @@
+int walk(int *p) {
+	int n;
+	n = 0;
+	while (p) {
+		n = n + 1;
+		p = *p;
+	}
+	return n;
+}
+
+int main() {
+	int *list;
+	int n;
+	int i;
+	list = makelist(100000);
+	n = 0;
+	for (i = 0; i < 1000; i = i + 1) {
+		n = n + walk(list);
+	}
+	if (n == 100000000)
+		return 42;
+	return 1;
+}
@@ -0,0 +1,20 @@
+int sum(int n) {
+	int s;
+	int i;
+	int j;
+	s = 0;
+	for (i = 0; i < n; i = i + 1) {
+		for (j = 0; j < n; j = j + 1) {
+			s = s + i * j - (i + j) / 3;
+		}
+	}
+	return s;
+}
+
+int main() {
+	int s;
+	s = sum(4000);
+	if (s - s / 1000000 * 1000000 == 333333)
+		return 42;
+	return s - s / 256 * 256;
+}
@@ -0,0 +1,214 @@
+// runtime is a benchmark of the code n9cc generates. It compiles each program in
+// bench/programs with n9cc -O0 and -O1, and with cc -O0 and -O2 as baselines, runs them and
+// reports the time they take, and their cycles and instructions when perf counters are
+// available. It also runs them by n9cc --run and --interp, whose times include compiling,
+// unless they need lib.c or the 64-bit helpers cc links them with.
+// Each program exits with 42 when it computes the right answer.
+//
+//   make bench-runtime
+//   bench/runtime [label]
+#define _DEFAULT_SOURCE
+#include <linux/perf_event.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// CC_FLAGS lets cc compile the programs like n9cc: int is 64 bits wide, functions are
+// declared by decls.h, and the warnings about the old style of the programs are suppressed.
+#define CC_FLAGS "-std=gnu89 -w -Dint=long -include bench/programs/decls.h"
+
+// Program is a program in bench/programs. frames and calls32 are list and calls reworked
+// to run in n9cc: frames builds its list on the stack instead of calling makelist, and calls32
+// keeps its sum within the 32 bits of the helpers n9cc runs programs with.
+typedef struct {
+	char *name;
+	bool native_only; // calls the functions of lib.c or needs the helpers to be 64-bit
+} Program;
+
+Program programs[] = {
+	{.name = "fib"},
+	{.name = "loops"},
+	{.name = "list", .native_only = true},
+	{.name = "frames"},
+	{.name = "calls", .native_only = true},
+	{.name = "calls32"},
+	{.name = "count"},
+};
+
+// Variant is a way to run a program. Either command compiles it to a binary, where %1$s is
+// the program, %2$s is the output and %3$s is the directory of helper.o and lib.o, or n9cc -O1 runs it
+// itself with the option in_process.
+typedef struct {
+	char *name;
+	char *command;
+	char *in_process;
+} Variant;
+
+Variant variants[] = {
+	{.name = "n9cc -O0", .command = "./n9cc -O0 bench/programs/%1$s.c > %2$s.s && cc -o %2$s %2$s.s %3$s/helper.o %3$s/lib.o"},
+	{.name = "n9cc -O1", .command = "./n9cc -O1 bench/programs/%1$s.c > %2$s.s && cc -o %2$s %2$s.s %3$s/helper.o %3$s/lib.o"},
+	{.name = "n9cc --run", .in_process = "--run"},
+	{.name = "n9cc --interp", .in_process = "--interp"},
+	{.name = "cc -O0", .command = "cc -O0 " CC_FLAGS " -o %2$s bench/programs/%1$s.c %3$s/helper.o %3$s/lib.o"},
+	{.name = "cc -O2", .command = "cc -O2 " CC_FLAGS " -o %2$s bench/programs/%1$s.c %3$s/helper.o %3$s/lib.o"},
+};
+#define NUM_VARIANTS (sizeof(variants) / sizeof(Variant))
+
+// Result is the best of the runs of a program.
+typedef struct {
+	double seconds;
+	long cycles;       // -1 if perf counters aren't available
+	long instructions; // -1 if perf counters aren't available
+} Result;
+
+// run runs a command by the shell and exits on failure.
+void run(char *fmt, ...) {
+	char cmd[4096];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(cmd, sizeof(cmd), fmt, ap);
+	va_end(ap);
+	if (system(cmd)) {
+		fprintf(stderr, "runtime: failed: %s\n", cmd);
+		exit(1);
+	}
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// open_counter opens a perf counter of the user-space events of a process, which starts
+// counting when the process calls exec. It returns -1 if perf isn't available, e.g. in
+// containers or with a strict perf_event_paranoid.
+int open_counter(pid_t pid, uint64_t config) {
+	struct perf_event_attr attr = {0};
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = config;
+	attr.disabled = 1;
+	attr.enable_on_exec = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+long read_counter(int fd) {
+	long val;
+	if (fd < 0 || read(fd, &val, sizeof(val)) != sizeof(val)) {
+		return -1;
+	}
+	close(fd);
+	return val;
+}
+
+// measure runs a command once. The child waits for the counters to be attached before exec.
+Result measure(char **argv) {
+	int fds[2];
+	if (pipe(fds)) {
+		perror("pipe");
+		exit(1);
+	}
+
+	double start = now();
+	pid_t pid = fork();
+	if (pid == 0) {
+		char c;
+		close(fds[1]);
+		read(fds[0], &c, 1);
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	close(fds[0]);
+	int cycles = open_counter(pid, PERF_COUNT_HW_CPU_CYCLES);
+	int instructions = open_counter(pid, PERF_COUNT_HW_INSTRUCTIONS);
+	write(fds[1], "x", 1);
+	close(fds[1]);
+
+	int status;
+	waitpid(pid, &status, 0);
+	double seconds = now() - start;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 42) {
+		fprintf(stderr, "runtime:");
+		for (char **arg = argv; *arg; arg++) {
+			fprintf(stderr, " %s", *arg);
+		}
+		fprintf(stderr, " computed a wrong answer (status %d)\n", status);
+		exit(1);
+	}
+	return (Result){seconds, read_counter(cycles), read_counter(instructions)};
+}
+
+int main(int argc, char **argv) {
+	char *label = argc > 1 ? argv[1] : "-";
+	int iterations = 3;
+
+	char date[32];
+	time_t t = time(NULL);
+	strftime(date, sizeof(date), "%Y-%m-%d", localtime(&t));
+
+	char dir[] = "/tmp/n9cc-runtime-XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	run("cc -O2 " CC_FLAGS " -c -o %s/helper.o helper.c", dir);
+	run("cc -O2 -c -o %s/lib.o bench/programs/lib.c", dir);
+
+	for (size_t p = 0; p < sizeof(programs) / sizeof(Program); p++) {
+		char *name = programs[p].name;
+		Result results[NUM_VARIANTS];
+		for (size_t v = 0; v < NUM_VARIANTS; v++) {
+			if (programs[p].native_only && !variants[v].command) {
+				continue;
+			}
+			char path[256];
+			char *argv[] = {path, NULL, NULL, NULL, NULL};
+			if (variants[v].command) {
+				snprintf(path, sizeof(path), "%s/%s-%zu", dir, name, v);
+				run(variants[v].command, name, path, dir);
+			} else {
+				snprintf(path, sizeof(path), "bench/programs/%s.c", name);
+				argv[0] = "./n9cc";
+				argv[1] = "-O1";
+				argv[2] = variants[v].in_process;
+				argv[3] = path;
+			}
+
+			for (int i = 0; i < iterations; i++) {
+				Result r = measure(argv);
+				if (i == 0 || r.seconds < results[v].seconds) {
+					results[v] = r;
+				}
+			}
+		}
+
+		Result *base = &results[NUM_VARIANTS - 1];
+		for (size_t v = 0; v < NUM_VARIANTS; v++) {
+			if (programs[p].native_only && !variants[v].command) {
+				continue;
+			}
+			Result *r = &results[v];
+			printf("%s %s %-7s %-13s %9.1f ms %6.2fx", date, label, name, variants[v].name,
+				   r->seconds * 1e3, r->seconds / base->seconds);
+			if (r->cycles >= 0 && r->instructions >= 0) {
+				printf(" %8.1f Mcycles %8.1f Minsns %5.2f IPC", r->cycles / 1e6, r->instructions / 1e6,
+					   (double)r->instructions / r->cycles);
+			} else {
+				printf(" (no perf counters)");
+			}
+			printf("\n");
+		}
+	}
+
+	run("rm -rf %s", dir);
+	return 0;
+}
@@ -1,12 +1,45 @@
-#include <ctype.h>
+#define _DEFAULT_SOURCE
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
+// TokenKind is the kind of a token. Each punctuator has a kind of its own, so the parser
+// tells tokens apart by comparing integers.
 typedef enum {
-			  TK_RESERVED,
+			  TK_EQ,     // ==
+			  TK_NE,     // !=
+			  TK_LE,     // <=
+			  TK_GE,     // >=
+			  TK_LT,     // <
+			  TK_GT,     // >
+			  TK_PLUS,   // +
+			  TK_MINUS,  // -
+			  TK_STAR,   // *
+			  TK_SLASH,  // /
+			  TK_AMP,    // &
+			  TK_LPAREN, // (
+			  TK_RPAREN, // )
+			  TK_ASSIGN, // =
+			  TK_COMMA,  // ,
+			  TK_SEMI,   // ;
+			  TK_LBRACE, // {
+			  TK_RBRACE, // }
 			  TK_INT,
 			  TK_RETURN,
 			  TK_IF,
@@ -19,34 +52,83 @@ typedef enum {
 			  TK_EOF,
 } TokenKind;
 
-typedef struct Token Token;
+// token_names are the spellings of the kinds of tokens used in diagnostics.
+char *token_names[] = {
+	"==", "!=", "<=", ">=", "<", ">", "+", "-", "*", "/", "&", "(", ")", "=", ",", ";", "{", "}",
+	"int", "return", "if", "else", "while", "for", "break", "identifier", "number", "end of input",
+};
 
-// Token represents a token.
-struct Token {
-	TokenKind kind;
-	Token *next;
-	int val;
-	char *str;
+// Tokens holds the tokens of the input as arrays indexed by the position of a token, so that
+// the parser scans them linearly. The i-th token is of the kind kinds[i] and spans lens[i]
+// bytes from user_input + offsets[i]. If it's an identifier, vals[i] is the id of its name, and
+// if it's a number, vals[i] is its value.
+typedef struct {
+	unsigned char *kinds;
+	int *offsets;
+	int *lens;
+	int *vals;
 	int len;
-};
+	int cap;
+	size_t high_water; // the largest size of the arrays in bytes
+} Tokens;
 
-// a token now focused on
-Token *token;
+// TOKEN_BYTES is the size of a token in the arrays.
+#define TOKEN_BYTES (sizeof(unsigned char) + 3 * sizeof(int))
+
+Tokens tokens;
+
+// the index of the token now focused on
+int token;
 
 // the entier input source code
 char *user_input;
 
-// error reports an error and exits with exit code 1.
+// the end of the input source code
+char *user_input_end;
+
+// the name of the input file used in diagnostics
+char *input_path = "<input>";
+
+// INPUT_PADDING is the number of zero bytes following the input. The tokenizer may look at
+// them past the end of the input.
+#define INPUT_PADDING 64
+
+// MAX_DIAG_LINE is the number of characters of a source line shown around an error.
+#define MAX_DIAG_LINE 120
+
+// error_at reports an error with the location in the input and exits with exit code 1.
+// It prints the line containing the location with a caret under it.
 void error_at(char *loc, char *fmt, ...) {
 	va_list ap;
 	va_start(ap, fmt);
 
-	int pos = loc - user_input;
-	fprintf(stderr, "%s\n", user_input);
-	fprintf(stderr, "%*s", pos, "");
-	fprintf(stderr, "^ ");
+	char *line = loc;
+	while (user_input < line && line[-1] != '\n') {
+		line--;
+	}
+	char *end = loc;
+	while (end < user_input_end && *end != '\n') {
+		end++;
+	}
+	int line_num = 1;
+	for (char *p = user_input; (p = memchr(p, '\n', line - p)); p++) {
+		line_num++;
+	}
+
+	fprintf(stderr, "%s:%d:%ld: ", input_path, line_num, (long)(loc - line) + 1);
 	vfprintf(stderr, fmt, ap);
 	fprintf(stderr, "\n");
+
+	// Show only a part of a long line around the location.
+	char *start = line;
+	if (loc - start > MAX_DIAG_LINE / 2) {
+		start = loc - MAX_DIAG_LINE / 2;
+	}
+	if (end - start > MAX_DIAG_LINE) {
+		end = start + MAX_DIAG_LINE;
+	}
+	fprintf(stderr, "%.*s\n", (int)(end - start), start);
+	fprintf(stderr, "%*s^\n", (int)(loc - start), "");
 	exit(1);
 }
 
@@ -59,207 +141,601 @@ void error(char *fmt, ...) {
 	exit(1);
 }
 
-// consume consumes a token and returns true when the the token now focused on is
-// equal to specified symbol. Otherwise, don't consume and returns false.
-bool consume(char *op) {
-	if (token->kind != TK_RESERVED || token->len != strlen(op)
-		|| memcmp(token->str, op, token->len)) {
-		return false;
+// ArenaChunk is a block of memory objects are carved out of.
+typedef struct ArenaChunk ArenaChunk;
+
+struct ArenaChunk {
+	ArenaChunk *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+// Arena is a bump-pointer allocator. Objects allocated from an arena aren't freed one by one;
+// they are released or reused together by arena_free or arena_reset.
+typedef struct {
+	char *name;
+	ArenaChunk *chunks;   // the chunk being filled comes first
+	ArenaChunk *spares;   // empty chunks kept by arena_reset
+	size_t used;          // bytes handed out
+	size_t high_water;    // the largest `used` has ever been
+	size_t reserved;      // bytes of the chunks
+	long num_allocs;
+} Arena;
+
+#define ARENA_CHUNK_SIZE (256 * 1024)
+
+Arena symbol_arena = {"symbol"};
+
+// arena_alloc returns zero-initialized memory of `size` bytes.
+void *arena_alloc(Arena *arena, size_t size) {
+	size = (size + 7) & ~(size_t)7;
+
+	ArenaChunk *chunk = arena->chunks;
+	if (!chunk || chunk->used + size > chunk->size) {
+		if (arena->spares && size <= arena->spares->size) {
+			chunk = arena->spares;
+			arena->spares = chunk->next;
+		} else {
+			size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+			chunk = calloc(1, sizeof(ArenaChunk) + chunk_size);
+			if (!chunk) {
+				error("out of memory");
+			}
+			chunk->size = chunk_size;
+			arena->reserved += chunk_size;
+		}
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
 	}
-	token = token->next;
-	return true;
+
+	void *p = chunk->data + chunk->used;
+	chunk->used += size;
+	arena->used += size;
+	arena->num_allocs++;
+	if (arena->used > arena->high_water) {
+		arena->high_water = arena->used;
+	}
+	return p;
 }
 
-bool consume_kw(TokenKind kind) {
-	if (token->kind == kind) {
-		token = token->next;
-		return true;
+// arena_strndup copies a string of `len` bytes into an arena and terminates it with NUL.
+char *arena_strndup(Arena *arena, char *s, int len) {
+	char *p = arena_alloc(arena, len + 1);
+	memcpy(p, s, len);
+	return p;
+}
+
+// arena_reset releases all objects of an arena but keeps its memory to reuse.
+void arena_reset(Arena *arena) {
+	ArenaChunk *next;
+	for (ArenaChunk *chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		memset(chunk->data, 0, chunk->used);
+		chunk->used = 0;
+		chunk->next = arena->spares;
+		arena->spares = chunk;
 	}
-	return false;
+	arena->chunks = NULL;
+	arena->used = 0;
+}
+
+// arena_free releases all objects and the memory of an arena.
+void arena_free(Arena *arena) {
+	ArenaChunk *lists[] = {arena->chunks, arena->spares};
+	for (int i = 0; i < 2; i++) {
+		ArenaChunk *next;
+		for (ArenaChunk *chunk = lists[i]; chunk; chunk = next) {
+			next = chunk->next;
+			free(chunk);
+		}
+	}
+	arena->chunks = NULL;
+	arena->spares = NULL;
+	arena->used = 0;
+	arena->reserved = 0;
+}
+
+// print_arena_stats prints the memory usage of an arena to stderr.
+void print_arena_stats(Arena *arena) {
+	fprintf(stderr, "arena %s: %zu bytes used, %zu bytes high-water, %zu bytes reserved, %ld allocations\n",
+			arena->name, arena->used, arena->high_water, arena->reserved, arena->num_allocs);
+}
+
+// tok_str returns the location of the i-th token in the input.
+char *tok_str(int i) {
+	return user_input + tokens.offsets[i];
+}
+
+// consume consumes a token and returns true when the the token now focused on is
+// of the specified kind. Otherwise, don't consume and returns false.
+bool consume(TokenKind kind) {
+	if (tokens.kinds[token] != kind) {
+		return false;
+	}
+	token++;
+	return true;
 }
 
-// consume consumes a token and returns it when the the token now focused on is
-// an identifier. Otherwise, don't consume and returns NULL.
-Token *consume_ident() {
-	if (token->kind != TK_IDENT) {
-		return NULL;
+// consume consumes a token and returns its index when the the token now focused on is
+// an identifier. Otherwise, don't consume and returns -1.
+int consume_ident() {
+	if (tokens.kinds[token] != TK_IDENT) {
+		return -1;
 	}
-	Token *tok = token;
-	token = token->next;
-	return tok;
+	return token++;
 }
 
-// expect checks whether the token now focused on is equal to a specified symbol.
+// expect checks whether the token now focused on is of a specified kind.
 // If the check passed, it consumes the token. Otherwise, it reports an error and exits.
-void expect(char *op) {
-	if (token->kind != TK_RESERVED || token->len != strlen(op)
-		|| memcmp(token->str, op, token->len)) {
-		error_at(token->str, "expected '%s'", op);
+void expect(TokenKind kind) {
+	if (tokens.kinds[token] != kind) {
+		error_at(tok_str(token), "expected '%s'", token_names[kind]);
 	}
-	token = token->next;
+	token++;
 }
 
 // expect_number checks whether the token now focused on is a number symbol.
 // If the check passed, it consumes the token and returns the value.
 // Otherwise, it reports an error and exits.
 int expect_number() {
-	if (token->kind != TK_NUM) {
-		error_at(token->str, "expected a number");
+	if (tokens.kinds[token] != TK_NUM) {
+		error_at(tok_str(token), "expected a number");
 	}
-	int val = token->val;
-	token = token->next;
-	return val;
+	return tokens.vals[token++];
 }
 
 // at_eof checks whether the token now focused on is the EOF.
 bool at_eof() {
-	return token->kind == TK_EOF;
+	return tokens.kinds[token] == TK_EOF;
 }
 
-// new_token returns a new token and links it to cur.
-Token *new_token(TokenKind kind, Token *cur, char *str, int len) {
-	Token *tok = calloc(1, sizeof(Token));
-	tok->kind = kind;
-	tok->str = str;
-	tok->len = len;
-	cur->next = tok;
-	return tok;
+// InternEntry is an entry of the table of interned strings.
+typedef struct {
+	char *str;
+	int len;
+	unsigned hash;
+	int id;
+} InternEntry;
+
+// intern_table stores each distinct identifier once, so that interned identifiers can be
+// compared by pointer. It's an open addressing hash table whose capacity is a power of 2.
+InternEntry *intern_table;
+int intern_cap;
+
+// idents holds the interned strings by their ids, which are numbered from 0 in the order the
+// strings are interned. The parser refers to names by id, so that a name fits in a Node and
+// indexes the tables of names directly.
+char **idents;
+int num_idents;
+int cap_idents;
+
+// hash_string returns the FNV-1a hash of a string.
+unsigned hash_string(char *s, int len) {
+	unsigned h = 2166136261u;
+	for (int i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	}
+	return h;
 }
 
-bool startswith(char *p, char *q) {
-	return memcmp(p, q, strlen(q)) == 0;
+// hash_ptr returns a hash of a pointer, which spreads the aligned addresses over the table.
+unsigned hash_ptr(void *p) {
+	unsigned long v = (unsigned long)p;
+	return (unsigned)((v >> 3) * 0x9E3779B97F4A7C15ul >> 32);
 }
 
-// tokenize tokenizes `user_input`.
-Token *tokenize() {
-	Token head;
-	head.next = NULL;
-	Token *cur = &head;
-	char *p = user_input;
+// intern_id returns the id of the interned copy of a string of `len` bytes.
+int intern_id(char *s, int len) {
+	if ((num_idents + 1) * 2 > intern_cap) {
+		int old_cap = intern_cap;
+		InternEntry *old = intern_table;
+		intern_cap = old_cap ? old_cap * 2 : 1024;
+		intern_table = calloc(intern_cap, sizeof(InternEntry));
+		for (int i = 0; i < old_cap; i++) {
+			if (!old[i].str) {
+				continue;
+			}
+			int j = old[i].hash & (intern_cap - 1);
+			while (intern_table[j].str) {
+				j = (j + 1) & (intern_cap - 1);
+			}
+			intern_table[j] = old[i];
+		}
+		free(old);
+	}
 
-	while (*p) {
-		if (isspace(*p)) {
-			p++;
-			continue;
+	unsigned h = hash_string(s, len);
+	for (int i = h & (intern_cap - 1);; i = (i + 1) & (intern_cap - 1)) {
+		InternEntry *e = &intern_table[i];
+		if (!e->str) {
+			if (num_idents == cap_idents) {
+				cap_idents = cap_idents ? cap_idents * 2 : 1024;
+				idents = realloc(idents, cap_idents * sizeof(char *));
+				if (!idents) {
+					error("out of memory");
+				}
+			}
+			e->str = arena_strndup(&symbol_arena, s, len);
+			e->len = len;
+			e->hash = h;
+			e->id = num_idents;
+			idents[num_idents] = e->str;
+			return num_idents++;
+		}
+		if (e->hash == h && e->len == len && !memcmp(e->str, s, len)) {
+			return e->id;
 		}
+	}
+}
 
-		if (strncmp(p, "int", 3) == 0 && !isalpha(*(p + 3))) {
-			cur = new_token(TK_INT, cur, p, 3);
-			p += 3;
-			continue;
+// intern returns the interned copy of a string of `len` bytes.
+char *intern(char *s, int len) {
+	return idents[intern_id(s, len)];
+}
+
+// grow_tokens grows the arrays of tokens.
+void grow_tokens() {
+	// Most tokens are a few bytes long, so the first guess seldom has to grow.
+	tokens.cap = tokens.cap ? tokens.cap * 2 : (user_input_end - user_input) / 4 + 1024;
+	tokens.kinds = realloc(tokens.kinds, tokens.cap * sizeof(unsigned char));
+	tokens.offsets = realloc(tokens.offsets, tokens.cap * sizeof(int));
+	tokens.lens = realloc(tokens.lens, tokens.cap * sizeof(int));
+	tokens.vals = realloc(tokens.vals, tokens.cap * sizeof(int));
+	if (!tokens.kinds || !tokens.offsets || !tokens.lens || !tokens.vals) {
+		error("out of memory");
+	}
+	if (tokens.cap * TOKEN_BYTES > tokens.high_water) {
+		tokens.high_water = tokens.cap * TOKEN_BYTES;
+	}
+}
+
+// add_token appends a token to tokens. val is the value of a number.
+static inline void add_token(TokenKind kind, char *start, int len, int val) {
+	if (tokens.len == tokens.cap) {
+		grow_tokens();
+	}
+	if (kind == TK_IDENT) {
+		val = intern_id(start, len);
+	}
+
+	// Read everything before storing to the arrays, as the compiler has to assume that the
+	// stores may overwrite tokens and reload it after each of them.
+	Tokens t = tokens;
+	int offset = start - user_input;
+	tokens.len++;
+	t.kinds[t.len] = kind;
+	t.offsets[t.len] = offset;
+	t.lens[t.len] = len;
+	t.vals[t.len] = val;
+}
+
+// free_tokens releases the memory of the tokens. tokens.len is kept for the statistics.
+void free_tokens() {
+	free(tokens.kinds);
+	free(tokens.offsets);
+	free(tokens.lens);
+	free(tokens.vals);
+	tokens.kinds = NULL;
+	tokens.offsets = NULL;
+	tokens.lens = NULL;
+	tokens.vals = NULL;
+	tokens.cap = 0;
+}
+
+// keyword_kind classifies a word. It returns the kind of the keyword, or TK_IDENT if the word
+// isn't a keyword. Dispatching on the length and the first character leaves at most one
+// candidate to compare, so the cost doesn't grow with the number of keywords.
+static inline TokenKind keyword_kind(char *p, int len) {
+	switch (len) {
+	case 2:
+		if (p[0] == 'i' && p[1] == 'f') {
+			return TK_IF;
 		}
-		if (strncmp(p, "return", 6) == 0 && !isalpha(*(p + 6))) {
-			cur = new_token(TK_RETURN, cur, p, 6);
-			p += 6;
-			continue;
+		break;
+	case 3:
+		if (p[0] == 'i' && !memcmp(p, "int", 3)) {
+			return TK_INT;
 		}
-		if (strncmp(p, "if", 2) == 0 && !isalpha(*(p + 2))) {
-			cur = new_token(TK_IF, cur, p, 2);
-			p += 2;
-			continue;
+		if (p[0] == 'f' && !memcmp(p, "for", 3)) {
+			return TK_FOR;
 		}
-		if (strncmp(p, "else", 4) == 0 && !isalpha(*(p + 4))) {
-			cur = new_token(TK_ELSE, cur, p, 4);
-			p += 4;
-			continue;
+		break;
+	case 4:
+		if (p[0] == 'e' && !memcmp(p, "else", 4)) {
+			return TK_ELSE;
 		}
-		if (strncmp(p, "while", 5) == 0 && !isalpha(*(p + 5))) {
-			cur = new_token(TK_WHILE, cur, p, 5);
-			p += 5;
-			continue;
+		break;
+	case 5:
+		if (p[0] == 'w' && !memcmp(p, "while", 5)) {
+			return TK_WHILE;
 		}
-		if (strncmp(p, "for", 3) == 0 && !isalpha(*(p + 3))) {
-			cur = new_token(TK_FOR, cur, p, 3);
-			p += 3;
-			continue;
+		if (p[0] == 'b' && !memcmp(p, "break", 5)) {
+			return TK_BREAK;
 		}
-		if (strncmp(p, "break", 5) == 0 && !isalpha(*(p + 5))) {
-			cur = new_token(TK_BREAK, cur, p, 5);
-			p += 5;
-			continue;
+		break;
+	case 6:
+		if (p[0] == 'r' && !memcmp(p, "return", 6)) {
+			return TK_RETURN;
 		}
-		
-		if (isalpha(*p)) {
-			char *start = p;
-			int len = 0;
-			do {
-				len++;
-				p++;
-			} while (isalnum(*p));
-			cur = new_token(TK_IDENT, cur, start, len);
+		break;
+	}
+	return TK_IDENT;
+}
+
+// punctuator returns the kind of the punctuator at p and stores its length to *len,
+// or returns TK_EOF if no punctuator starts at p.
+static inline TokenKind punctuator(char *p, int *len) {
+	*len = 2;
+	if (p[1] == '=') {
+		switch (p[0]) {
+		case '=':
+			return TK_EQ;
+		case '!':
+			return TK_NE;
+		case '<':
+			return TK_LE;
+		case '>':
+			return TK_GE;
+		}
+	}
+
+	*len = 1;
+	switch (p[0]) {
+	case '<':
+		return TK_LT;
+	case '>':
+		return TK_GT;
+	case '+':
+		return TK_PLUS;
+	case '-':
+		return TK_MINUS;
+	case '*':
+		return TK_STAR;
+	case '/':
+		return TK_SLASH;
+	case '&':
+		return TK_AMP;
+	case '(':
+		return TK_LPAREN;
+	case ')':
+		return TK_RPAREN;
+	case '=':
+		return TK_ASSIGN;
+	case ',':
+		return TK_COMMA;
+	case ';':
+		return TK_SEMI;
+	case '{':
+		return TK_LBRACE;
+	case '}':
+		return TK_RBRACE;
+	}
+	return TK_EOF;
+}
+
+// CharClass is a class of bytes of the input. The classes are those of isspace, isalpha and
+// isdigit in the C locale, so that the tokenizer doesn't depend on the locale.
+typedef enum {
+	CC_SPACE = 1,
+	CC_ALPHA = 2,
+	CC_DIGIT = 4,
+} CharClass;
+
+// char_class holds the classes of the bytes.
+unsigned char char_class[256];
+
+// LexerKind is an implementation of the scans of the tokenizer.
+typedef enum {
+	LEX_SCALAR,
+	LEX_SSE2,
+	LEX_AVX2,
+} LexerKind;
+
+char *lexer_names[] = {"scalar", "sse2", "avx2"};
+
+// lexer_kind is the implementation used by the tokenizer. It's the widest one the CPU supports
+// unless -flexer= asks for a narrower one.
+LexerKind lexer_kind = LEX_AVX2;
+
+// The skip_class_* functions return the first byte from p which isn't in any of the classes in
+// cls. The input is followed by zero bytes, which are in no class, so they may read up to 31
+// bytes past the run but never past the padding.
+
+// skip_class_scalar looks up the bytes one at a time.
+static inline char *skip_class_scalar(char *p, int cls) {
+	while (char_class[(unsigned char)*p] & cls) {
+		p++;
+	}
+	return p;
+}
+
+#ifdef __x86_64__
+// in_range_sse2 returns the bytes of x between lo and hi as 0xff, comparing them as unsigned.
+static inline __m128i in_range_sse2(__m128i x, char lo, char hi) {
+	__m128i t = _mm_sub_epi8(x, _mm_set1_epi8(lo));
+	return _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(hi - lo)), t);
+}
+
+// skip_class_sse2 classifies 16 bytes at a time.
+static inline char *skip_class_sse2(char *p, int cls) {
+	for (;; p += 16) {
+		__m128i x = _mm_loadu_si128((__m128i *)p);
+		__m128i in = _mm_setzero_si128();
+		if (cls & CC_SPACE) {
+			in = _mm_or_si128(in, _mm_cmpeq_epi8(x, _mm_set1_epi8(' ')));
+			in = _mm_or_si128(in, in_range_sse2(x, '\t', '\r'));
+		}
+		if (cls & CC_ALPHA) {
+			in = _mm_or_si128(in, in_range_sse2(_mm_or_si128(x, _mm_set1_epi8(0x20)), 'a', 'z'));
+		}
+		if (cls & CC_DIGIT) {
+			in = _mm_or_si128(in, in_range_sse2(x, '0', '9'));
+		}
+		unsigned out = ~_mm_movemask_epi8(in) & 0xffff;
+		if (out) {
+			return p + __builtin_ctz(out);
+		}
+	}
+}
+
+// in_range_avx2 is in_range_sse2 for 32 bytes.
+__attribute__((target("avx2")))
+static inline __m256i in_range_avx2(__m256i x, char lo, char hi) {
+	__m256i t = _mm256_sub_epi8(x, _mm256_set1_epi8(lo));
+	return _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(hi - lo)), t);
+}
+
+// skip_class_avx2 classifies 32 bytes at a time.
+__attribute__((target("avx2,bmi")))
+static inline char *skip_class_avx2(char *p, int cls) {
+	for (;; p += 32) {
+		__m256i x = _mm256_loadu_si256((__m256i *)p);
+		__m256i in = _mm256_setzero_si256();
+		if (cls & CC_SPACE) {
+			in = _mm256_or_si256(in, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')));
+			in = _mm256_or_si256(in, in_range_avx2(x, '\t', '\r'));
+		}
+		if (cls & CC_ALPHA) {
+			in = _mm256_or_si256(in, in_range_avx2(_mm256_or_si256(x, _mm256_set1_epi8(0x20)), 'a', 'z'));
+		}
+		if (cls & CC_DIGIT) {
+			in = _mm256_or_si256(in, in_range_avx2(x, '0', '9'));
+		}
+		unsigned out = ~(unsigned)_mm256_movemask_epi8(in);
+		if (out) {
+			return p + _tzcnt_u32(out);
+		}
+	}
+}
+#endif
+
+// scan_tokens adds the tokens from p to the end of the input and returns the end. It's inlined
+// into a copy per implementation of skip_class, so that the scans are inlined too and the
+// implementation is picked once per input instead of once per token.
+static inline __attribute__((always_inline))
+char *scan_tokens(char *p, char *(*skip_class)(char *p, int cls)) {
+	while (p < user_input_end) {
+		int cls = char_class[(unsigned char)*p];
+
+		// Most runs of spaces are a single space, which isn't worth a scan.
+		if (cls & CC_SPACE) {
+			p++;
+			if (char_class[(unsigned char)*p] & CC_SPACE) {
+				p = skip_class(p, CC_SPACE);
+			}
 			continue;
 		}
 
-		if (startswith(p, "==") || startswith(p, "!=")
-			|| startswith(p, "<=") || startswith(p, ">=")) {
-			cur = new_token(TK_RESERVED, cur, p, 2);
-			p += 2;
+		if (cls & CC_ALPHA) {
+			char *start = p;
+			p = skip_class(p + 1, CC_ALPHA | CC_DIGIT);
+			int len = p - start;
+			add_token(keyword_kind(start, len), start, len, 0);
 			continue;
 		}
 
-		if (strchr("<>+-*/&()=,;{}", *p)) {
-			cur = new_token(TK_RESERVED, cur, p++, 1);
+		int len;
+		TokenKind kind = punctuator(p, &len);
+		if (kind != TK_EOF) {
+			add_token(kind, p, len, 0);
+			p += len;
 			continue;
 		}
 
-		if (isdigit(*p)) {
-			cur = new_token(TK_NUM, cur, p, 0);
-			cur->val = strtol(p, &p, 10);
+		if (cls & CC_DIGIT) {
+			char *start = p;
+			p = skip_class(p + 1, CC_DIGIT);
+			// Like strtol, the value stops at LONG_MAX when it overflows, and it's then
+			// truncated to int.
+			long val = 0;
+			for (char *q = start; q < p; q++) {
+				int d = *q - '0';
+				if (val > (LONG_MAX - d) / 10) {
+					val = LONG_MAX;
+					break;
+				}
+				val = val * 10 + d;
+			}
+			add_token(TK_NUM, start, p - start, (int)val);
 			continue;
 		}
 
 		error_at(p, "invalid token");
 	}
+	return p;
+}
+
+char *scan_tokens_scalar(char *p) {
+	return scan_tokens(p, skip_class_scalar);
+}
+
+#ifdef __x86_64__
+char *scan_tokens_sse2(char *p) {
+	return scan_tokens(p, skip_class_sse2);
+}
+
+__attribute__((target("avx2,bmi")))
+char *scan_tokens_avx2(char *p) {
+	return scan_tokens(p, skip_class_avx2);
+}
+#endif
+
+// lex is the copy of scan_tokens picked by init_lexer.
+char *(*lex)(char *p);
+
+// init_lexer fills char_class and picks the implementation of the scans, falling back from
+// lexer_kind to what the CPU supports.
+void init_lexer() {
+	for (int c = 0; c < 256; c++) {
+		if (c == ' ' || (c >= '\t' && c <= '\r')) {
+			char_class[c] = CC_SPACE;
+		} else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') {
+			char_class[c] = CC_ALPHA;
+		} else if (c >= '0' && c <= '9') {
+			char_class[c] = CC_DIGIT;
+		}
+	}
+
+#ifdef __x86_64__
+	__builtin_cpu_init();
+	if (lexer_kind == LEX_AVX2 && !(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi"))) {
+		lexer_kind = LEX_SSE2;
+	}
+	switch (lexer_kind) {
+	case LEX_AVX2:
+		lex = scan_tokens_avx2;
+		return;
+	case LEX_SSE2:
+		lex = scan_tokens_sse2;
+		return;
+	default:
+		break;
+	}
+#else
+	lexer_kind = LEX_SCALAR;
+#endif
+	lex = scan_tokens_scalar;
+}
 
-	new_token(TK_EOF, cur, p, 0);
-	return head.next;
+// tokenize tokenizes `user_input` into tokens and focuses on the first one.
+void tokenize() {
+	if (user_input_end - user_input >= INT_MAX) {
+		error("%s: the input is too large", input_path);
+	}
+	if (!lex) {
+		init_lexer();
+	}
+	tokens.len = 0;
+	token = 0;
+	char *p = lex(user_input);
+	add_token(TK_EOF, p, 0, 0);
 }
 
 void print_tokens() {
 	printf("tokens:\n");
-	for (Token *tok = token; tok != NULL; tok = tok->next) {
-		char symbol[256];
-		if (tok->str) {
-			if (tok->len < 255) {
-				memcpy(symbol, tok->str, tok->len);
-				symbol[tok->len] = '\0';
-			} else {
-				strncpy(symbol, "too long symbol", 255);
-			}
-		}
-		
-		switch (tok->kind) {
-		case TK_RESERVED:
-			printf("  TK_RESERVED %s\n", symbol);
-			break;
-		case TK_RETURN:
-			printf("  TK_RETURN\n");
-			break;
-		case TK_IF:
-			printf("  TK_IF\n");
-			break;
-		case TK_ELSE:
-			printf("  TK_ELSE\n");
-			break;
-		case TK_WHILE:
-			printf("  TK_WHILE\n");
-			break;
-		case TK_FOR:
-			printf("  TK_FOR\n");
-			break;
-		case TK_BREAK:
-			printf("  TK_BREAK\n");
-			break;
-		case TK_IDENT:
-			printf("  TK_IDENT %s\n", symbol);
-			break;
-		case TK_NUM:
-			printf("  TK_NUM %d\n", tok->val);
-			break;
-		case TK_EOF:
-			printf("  TK_EOF\n");
-			break;
-		}
+	for (int i = 0; i < tokens.len; i++) {
+		printf("  %-12s %.*s\n", token_names[tokens.kinds[i]], tokens.lens[i], tok_str(i));
 	}
 }
 
@@ -281,7 +757,6 @@ typedef enum {
 
 			  ND_EXPR_SENTINEL, // The above nodes are expression. Don't use this for any node kind.
 
-			  ND_FUNCDEF, // function definition
 			  ND_RETURN,  // return
 			  ND_IF,      // if
 			  ND_WHILE,   // while
@@ -297,25 +772,91 @@ bool is_expr_node(NodeKind kind) {
 	return false;
 }
 
+// NodeId is the index of a node in nodes. 0 is no node.
+typedef unsigned NodeId;
+
 typedef struct Node Node;
 
-// Node represents a node of an AST.
+// Node represents a node of an AST in 16 bytes. The children are referred to by NodeId. The
+// nodes with a list of children or more than two of them keep their children contiguously in
+// node_lists from lhs:
+//   ND_BLOCK, ND_FUNCCALL: rhs children
+//   ND_IF: condition, if clause and else clause
+//   ND_FOR: init, condition, increment and body
+// A missing optional child is 0.
 struct Node {
-	NodeKind kind;
-	Node *lhs;
-	Node *rhs;
-	Node *opt1;
-	Node *opt2;
-	int val;
-	char *str;
-	int offset;
-	int label_num;
-	int func_id;
-	char *func_name;
-	Node *next;
+	unsigned char kind;
+	unsigned short reg_need;
+	NodeId lhs;
+	NodeId rhs;
+	union {
+		int val;       // ND_NUM
+		int offset;    // ND_LVAR
+		int label_num; // ND_IF, ND_WHILE, ND_FOR
+		int name;      // ND_FUNCCALL: the id of the name of the callee
+	};
 };
 
-void print_node(Node *node, int depth, char *prefix) {
+// nodes is the pool of the nodes. Its capacity doubles when it's full, so a pointer to a node
+// is valid only until the next node is made.
+Node *nodes;
+int num_nodes = 1;
+int cap_nodes;
+
+// node_lists holds the children of the nodes which have a list of them.
+NodeId *node_lists;
+int num_node_lists;
+int cap_node_lists;
+
+// node_stack holds the children of the lists being parsed, which are copied to node_lists when
+// their list ends, so that a list nested in another one doesn't split it.
+NodeId *node_stack;
+int num_node_stack;
+int cap_node_stack;
+
+// nd returns the node of an id, or NULL for 0.
+Node *nd(NodeId id) {
+	return id ? &nodes[id] : NULL;
+}
+
+// has_list returns true if the children of a node are kept in node_lists.
+bool has_list(NodeKind kind) {
+	return kind == ND_BLOCK || kind == ND_FUNCCALL || kind == ND_IF || kind == ND_FOR;
+}
+
+// num_children returns the number of the children of a node, including the missing ones.
+int num_children(Node *node) {
+	switch (node->kind) {
+	case ND_NUM:
+	case ND_LVAR:
+	case ND_BREAK:
+		return 0;
+	case ND_ADDR:
+	case ND_DEREF:
+	case ND_RETURN:
+		return 1;
+	case ND_IF:
+		return 3;
+	case ND_FOR:
+		return 4;
+	case ND_BLOCK:
+	case ND_FUNCCALL:
+		return node->rhs;
+	default:
+		return 2;
+	}
+}
+
+// child returns the i-th child of a node.
+NodeId child(Node *node, int i) {
+	if (has_list(node->kind)) {
+		return node_lists[node->lhs + i];
+	}
+	return i == 0 ? node->lhs : node->rhs;
+}
+
+void print_node(NodeId id, int depth, char *prefix) {
+	Node *node = nd(id);
 	if (!node) {
 		return;
 	}
@@ -380,8 +921,10 @@ void print_node(Node *node, int depth, char *prefix) {
 		printf("NUMBER: %d\n", node->val);
 		break;
 	case ND_FUNCCALL:
-		printf("CALL: %s\n", node->func_name);
-		print_node(node->lhs, depth + 1, "PARAMETER");
+		printf("CALL: %s\n", idents[node->name]);
+		for (int i = 0; i < node->rhs; i++) {
+			print_node(child(node, i), depth + 1, "PARAMETER");
+		}
 		break;
 	case ND_ADDR:
 		printf("ADDRESS\n");
@@ -391,20 +934,15 @@ void print_node(Node *node, int depth, char *prefix) {
 		printf("DEREFERENCE\n");
 		print_node(node->lhs, depth + 1, NULL);
 		break;
-	case ND_FUNCDEF:
-		printf("FUNCTION: #%d %s\n", node->func_id, node->func_name);
-		print_node(node->lhs, depth + 1, "ARGUMENT");
-		print_node(node->rhs, depth + 1, NULL);
-		break;
 	case ND_RETURN:
 		printf("RETURN\n");
 		print_node(node->lhs, depth + 1, NULL);
 		break;
 	case ND_IF:
 		printf("IF\n");
-		print_node(node->lhs, depth + 1, "CONDITION");
-		print_node(node->rhs, depth + 1, "IF CLAUSE");
-		print_node(node->opt1, depth + 1, "ELSE CLAUSE");
+		print_node(child(node, 0), depth + 1, "CONDITION");
+		print_node(child(node, 1), depth + 1, "IF CLAUSE");
+		print_node(child(node, 2), depth + 1, "ELSE CLAUSE");
 		break;
 	case ND_WHILE:
 		printf("WHILE\n");
@@ -412,202 +950,316 @@ void print_node(Node *node, int depth, char *prefix) {
 		break;
 	case ND_FOR:
 		printf("FOR\n");
-		print_node(node->lhs, depth + 1, "INIT");
-		print_node(node->rhs, depth + 1, "CONDITION");
-		print_node(node->opt1, depth + 1, "INCREMENT");
-		print_node(node->opt2, depth + 1, "BODY");
+		print_node(child(node, 0), depth + 1, "INIT");
+		print_node(child(node, 1), depth + 1, "CONDITION");
+		print_node(child(node, 2), depth + 1, "INCREMENT");
+		print_node(child(node, 3), depth + 1, "BODY");
 		break;
 	case ND_BREAK:
 		printf("BREAK\n");
 		break;
 	case ND_BLOCK:
 		printf("BLOCK\n");
-		print_node(node->lhs, depth + 1, NULL);
+		for (int i = 0; i < node->rhs; i++) {
+			print_node(child(node, i), depth + 1, NULL);
+		}
 		break;
 	default:
 		printf("UNKNOWN NODE KIND: %d\n", node->kind);
 		break;
 	}
+}
 
-	print_node(node->next, depth, prefix);
+// new_node returns a new node.
+NodeId new_node(NodeKind kind, NodeId lhs, NodeId rhs) {
+	if (num_nodes >= cap_nodes) {
+		cap_nodes = cap_nodes ? cap_nodes * 2 : 4096;
+		nodes = realloc(nodes, cap_nodes * sizeof(Node));
+		if (!nodes) {
+			error("out of memory");
+		}
+	}
+	nodes[num_nodes] = (Node){kind, 0, lhs, rhs};
+	return num_nodes++;
 }
 
-void print_code(Node **code) {
-	for (int i = 0; code[i]; i++) {
-		print_node(code[i], 0, NULL);
+// push_node pushes a child of the list being parsed to node_stack.
+void push_node(NodeId id) {
+	if (num_node_stack == cap_node_stack) {
+		cap_node_stack = cap_node_stack ? cap_node_stack * 2 : 256;
+		node_stack = realloc(node_stack, cap_node_stack * sizeof(NodeId));
+		if (!node_stack) {
+			error("out of memory");
+		}
 	}
+	node_stack[num_node_stack++] = id;
 }
 
-// new_node returns a new node.
-Node *new_node(NodeKind kind, Node *lhs, Node *rhs) {
-	Node *node = calloc(1, sizeof(Node));
-	node->kind = kind;
-	node->lhs = lhs;
-	node->rhs = rhs;
-	return node;
+// pop_list moves the children pushed to node_stack since mark to node_lists and returns where
+// they start.
+int pop_list(int mark) {
+	int len = num_node_stack - mark;
+	if (num_node_lists + len > cap_node_lists) {
+		while (num_node_lists + len > cap_node_lists) {
+			cap_node_lists = cap_node_lists ? cap_node_lists * 2 : 4096;
+		}
+		node_lists = realloc(node_lists, cap_node_lists * sizeof(NodeId));
+		if (!node_lists) {
+			error("out of memory");
+		}
+	}
+	int start = num_node_lists;
+	memcpy(node_lists + start, node_stack + mark, len * sizeof(NodeId));
+	num_node_lists += len;
+	num_node_stack = mark;
+	return start;
+}
+
+// new_node_list returns a new node whose children are those pushed to node_stack since mark.
+NodeId new_node_list(NodeKind kind, int mark) {
+	int len = num_node_stack - mark;
+	return new_node(kind, pop_list(mark), len);
 }
 
 // new_node_if returns a new if statment node.
-Node *new_node_if(Node *cond, Node *true_stmt, Node *false_stmt) {
-	Node *node = calloc(1, sizeof(Node));
-	node->kind = ND_IF;
-	node->lhs = cond;
-	node->rhs = true_stmt;
-	node->opt1 = false_stmt;
-	return node;
+NodeId new_node_if(NodeId cond, NodeId true_stmt, NodeId false_stmt) {
+	int mark = num_node_stack;
+	push_node(cond);
+	push_node(true_stmt);
+	push_node(false_stmt);
+	return new_node_list(ND_IF, mark);
 }
 
 // new_node_for returns a new for statment node.
-Node *new_node_for(Node *init, Node *cond, Node *increment, Node *stmt) {
-	Node *node = calloc(1, sizeof(Node));
-	node->kind = ND_FOR;
-	node->lhs = init;
-	node->rhs = cond;
-	node->opt1 = increment;
-	node->opt2 = stmt;
-	return node;
+NodeId new_node_for(NodeId init, NodeId cond, NodeId increment, NodeId stmt) {
+	int mark = num_node_stack;
+	push_node(init);
+	push_node(cond);
+	push_node(increment);
+	push_node(stmt);
+	return new_node_list(ND_FOR, mark);
 }
 
 // new_node_num returns a new node that represents an integer.
-Node *new_node_num(int val) {
-	Node *node = calloc(1, sizeof(Node));
-	node->kind = ND_NUM;
-	node->val = val;
-	return node;
+NodeId new_node_num(int val) {
+	NodeId id = new_node(ND_NUM, 0, 0);
+	nodes[id].val = val;
+	return id;
 }
 
-// new_node_funccall returns a new function call node.
-Node *new_node_funccall(char *func_name, Node *params) {
-	Node *node = calloc(1, sizeof(Node));
-	node->kind = ND_FUNCCALL;
-	node->func_name = func_name;
-	node->lhs = params;
-	return node;
+// new_node_funccall returns a new function call node whose arguments are those pushed to
+// node_stack since mark. name is the id of the name of the callee.
+NodeId new_node_funccall(int name, int mark) {
+	NodeId id = new_node_list(ND_FUNCCALL, mark);
+	nodes[id].name = name;
+	return id;
 }
 
 typedef struct LVar LVar;
 
+// LVar represents a local variable.
 struct LVar {
-	LVar *next;
-	char *name;
-	int len;
+	int name;       // the id of the name
 	int offset;
+	int depth;      // the depth of the scope declaring the variable
+	LVar *shadowed; // the variable of the same name in an outer scope
 };
 
-int func_id;
-LVar *locals[100];
+// bindings maps the id of a name to the innermost variable visible by the name, or NULL.
+LVar **bindings;
+int cap_bindings;
+
+// scope_vars is the stack of the variables declared in the open scopes, and scope_marks
+// holds where each open scope starts in scope_vars.
+LVar **scope_vars;
+int num_scope_vars;
+int cap_scope_vars;
+int *scope_marks;
+int scope_depth;
+int cap_scope_marks;
 
-LVar *find_lvar(int func_id, Token *tok) {
-	for (LVar *var = locals[func_id]; var; var = var->next) {
-		if (var->len == tok->len && !memcmp(tok->str, var->name, var->len)) {
-			return var;
+// lvar_offset is the offset of the last local variable of the function being parsed,
+// which is also the size of its local variables.
+int lvar_offset;
+
+// bind binds a name to a variable.
+void bind(int name, LVar *var) {
+	if (name >= cap_bindings) {
+		int old_cap = cap_bindings;
+		cap_bindings = cap_bindings ? cap_bindings : 256;
+		while (name >= cap_bindings) {
+			cap_bindings *= 2;
+		}
+		bindings = realloc(bindings, cap_bindings * sizeof(LVar *));
+		if (!bindings) {
+			error("out of memory");
 		}
+		memset(bindings + old_cap, 0, (cap_bindings - old_cap) * sizeof(LVar *));
 	}
-	return NULL;
+	bindings[name] = var;
 }
 
-void program();
-Node *func_def();
-Node *stmt();
-Node *expr();
-Node *assign();
-Node *equality();
-Node *relational();
-Node *add();
-Node *mul();
-Node *unary();
-Node *primary();
-
-Node *code[100];
-int label_num;
+// find_lvar returns the innermost visible variable named by a token, or NULL if there isn't one.
+LVar *find_lvar(int tok) {
+	int name = tokens.vals[tok];
+	return name < cap_bindings ? bindings[name] : NULL;
+}
 
-// program = func_def+
-void program() {
-	int i = 0;
-	while (!at_eof()) {
-		code[i++] = func_def();
+// enter_scope opens a scope.
+void enter_scope() {
+	if (scope_depth == cap_scope_marks) {
+		cap_scope_marks = cap_scope_marks ? cap_scope_marks * 2 : 64;
+		scope_marks = realloc(scope_marks, cap_scope_marks * sizeof(int));
 	}
-	code[i] = NULL;
+	scope_marks[scope_depth++] = num_scope_vars;
+}
 
-	if (code[0] == NULL) {
-		error("expected function definition at least one");
+// leave_scope closes the innermost scope. The variables declared in it become invisible and
+// the variables they shadowed are visible again.
+void leave_scope() {
+	int mark = scope_marks[--scope_depth];
+	while (num_scope_vars > mark) {
+		LVar *var = scope_vars[--num_scope_vars];
+		bind(var->name, var->shadowed);
 	}
 }
 
-// func_def: "int" ident "(" ("int" ident ("," "int" ident)*)? ")" "{" stmt* "}"
-Node *func_def() {
-	if (!consume_kw(TK_INT)) {
-		error("expected `int`");
+// declare_lvar declares a local variable named by a token in the innermost scope and returns it.
+// Declaring a name again in the same scope returns the variable already declared.
+LVar *declare_lvar(int tok) {
+	LVar *shadowed = find_lvar(tok);
+	if (shadowed && shadowed->depth == scope_depth) {
+		return shadowed;
 	}
-	
-	Token *id_tok = consume_ident();
-	if (!id_tok) {
-		error("expected an identifier");
+
+	LVar *var = arena_alloc(&symbol_arena, sizeof(LVar));
+	var->name = tokens.vals[tok];
+	lvar_offset += 8;
+	var->offset = lvar_offset;
+	var->depth = scope_depth;
+	var->shadowed = shadowed;
+	bind(var->name, var);
+
+	if (num_scope_vars == cap_scope_vars) {
+		cap_scope_vars = cap_scope_vars ? cap_scope_vars * 2 : 256;
+		scope_vars = realloc(scope_vars, cap_scope_vars * sizeof(LVar *));
 	}
+	scope_vars[num_scope_vars++] = var;
+	return var;
+}
 
-	expect("(");
-	Node args;
-	args.next = NULL;
-	Node *arg = &args;
-	while (!consume(")")) {
-		if (!consume_kw(TK_INT)) {
-			error("expected `int`");
-		}
+void program();
+void func_def();
+NodeId stmt();
+NodeId expr();
+NodeId binary(int min_prec);
+NodeId unary();
+NodeId primary();
 
-		while (consume("*"));
-		
-		Token *arg_tok = consume_ident();
-		if (!arg_tok) {
-			error("expected an identifier");
-		}
+// Function is a function definition. Its parameters are ND_LVAR nodes kept contiguously in
+// node_lists from params.
+typedef struct {
+	char *name; // interned
+	int params;
+	int num_params;
+	NodeId body;     // ND_BLOCK
+	int locals_size; // the size of the local variables
+} Function;
 
-		Node *decl = calloc(1, sizeof(Node));
-		decl->kind = ND_LVAR;
+// code is the list of the function definitions, indexed by their ids.
+// Its capacity doubles when it's full.
+Function *code;
+int num_code;
+int cap_code;
 
-		LVar *lvar = find_lvar(func_id, arg_tok);
-		if (lvar) {
-			decl->offset = lvar->offset;
-		} else {
-			lvar = calloc(1, sizeof(LVar));
-			lvar->next = locals[func_id];
-			lvar->name = arg_tok->str;
-			lvar->len = arg_tok->len;
-			if (locals[func_id]) {
-				lvar->offset = locals[func_id]->offset + 8;
-			} else {
-				lvar->offset = 8;
-			}
-			locals[func_id] = lvar;
-			decl->offset = lvar->offset;
+void print_code() {
+	for (int i = 0; i < num_code; i++) {
+		printf("FUNCTION: #%d %s\n", i, code[i].name);
+		for (int j = 0; j < code[i].num_params; j++) {
+			print_node(node_lists[code[i].params + j], 1, "ARGUMENT");
 		}
+		print_node(code[i].body, 1, NULL);
+	}
+}
 
-		arg->next = decl;
-		arg = arg->next;
-		if (consume(")")) {
-			break;
+// label_num numbers the labels of the function being parsed. Labels are numbered per
+// function so that its code doesn't depend on the other functions.
+int label_num;
+
+// add_code appends a function definition to code.
+void add_code(Function func) {
+	if (num_code == cap_code) {
+		cap_code = cap_code ? cap_code * 2 : 64;
+		code = realloc(code, cap_code * sizeof(Function));
+		if (!code) {
+			error("out of memory");
 		}
-		expect(",");
+	}
+	code[num_code++] = func;
+}
+
+// program = func_def+
+void program() {
+	while (!at_eof()) {
+		func_def();
 	}
 
-	expect("{");
-	Node block_head;
-	block_head.next = NULL;
-	Node *stmt_node = &block_head;
-	while(!consume("}")) {
-		stmt_node->next = stmt();
-		stmt_node = stmt_node->next;
+	if (num_code == 0) {
+		error("expected function definition at least one");
 	}
-	Node *block_node = new_node(ND_BLOCK, block_head.next, NULL);
+}
 
-	char *func_name = calloc(id_tok->len + 1, sizeof(char));
-	memcpy(func_name, id_tok->str, id_tok->len);
-	func_name[id_tok->len] = '\0';
+// func_def: "int" ident "(" ("int" ident ("," "int" ident)*)? ")" "{" stmt* "}"
+void func_def() {
+	if (!consume(TK_INT)) {
+		error_at(tok_str(token), "expected `int`");
+	}
 	
-	Node *node = new_node(ND_FUNCDEF, args.next, block_node);
-	node->func_id = func_id++;
-	node->func_name = func_name;
+	int id_tok = consume_ident();
+	if (id_tok < 0) {
+		error_at(tok_str(token), "expected an identifier");
+	}
 
-	return node;
+	// The parameters and the body of a function share a scope.
+	lvar_offset = 0;
+	label_num = 0;
+	enter_scope();
+
+	expect(TK_LPAREN);
+	int params = num_node_stack;
+	while (!consume(TK_RPAREN)) {
+		if (!consume(TK_INT)) {
+			error_at(tok_str(token), "expected `int`");
+		}
+
+		while (consume(TK_STAR));
+		
+		int arg_tok = consume_ident();
+		if (arg_tok < 0) {
+			error_at(tok_str(token), "expected an identifier");
+		}
+
+		NodeId decl = new_node(ND_LVAR, 0, 0);
+		nodes[decl].offset = declare_lvar(arg_tok)->offset;
+		push_node(decl);
+
+		if (consume(TK_RPAREN)) {
+			break;
+		}
+		expect(TK_COMMA);
+	}
+	int num_params = num_node_stack - params;
+	params = pop_list(params);
+
+	expect(TK_LBRACE);
+	int mark = num_node_stack;
+	while(!consume(TK_RBRACE)) {
+		push_node(stmt());
+	}
+	NodeId body = new_node_list(ND_BLOCK, mark);
+	leave_scope();
+
+	add_code((Function){idents[tokens.vals[id_tok]], params, num_params, body, lvar_offset});
 }
 
 // stmt = expr ";"
@@ -618,572 +1270,3461 @@ Node *func_def() {
 //      | "break" ";"
 //      | "{" stmt* "}"
 //      | "int" "*"* ident ";"
-Node *stmt() {
-	if (consume_kw(TK_RETURN)) {
-		Node *node = new_node(ND_RETURN, expr(), NULL);
-		expect(";");
+NodeId stmt() {
+	if (consume(TK_RETURN)) {
+		NodeId node = new_node(ND_RETURN, expr(), 0);
+		expect(TK_SEMI);
 		return node;
-	} else if (consume_kw(TK_IF)) {
-		expect("(");
-		Node *cond_node = expr();
-		expect(")");
-		Node *true_stmt_node = stmt();
-		Node *false_stmt_node = NULL;
-		if (consume_kw(TK_ELSE)) {
+	} else if (consume(TK_IF)) {
+		expect(TK_LPAREN);
+		NodeId cond_node = expr();
+		expect(TK_RPAREN);
+		NodeId true_stmt_node = stmt();
+		NodeId false_stmt_node = 0;
+		if (consume(TK_ELSE)) {
 			false_stmt_node = stmt();
 		}
-		Node *if_node = new_node_if(cond_node, true_stmt_node, false_stmt_node);
-		if_node->label_num = label_num++;
+		NodeId if_node = new_node_if(cond_node, true_stmt_node, false_stmt_node);
+		nodes[if_node].label_num = label_num++;
 		return if_node;
-	} else if (consume_kw(TK_WHILE)) {
-		expect("(");
-		Node *cond_node = expr();
-		expect(")");
-		Node *while_node = new_node(ND_WHILE, cond_node, stmt());
-		while_node->label_num = label_num++;
+	} else if (consume(TK_WHILE)) {
+		expect(TK_LPAREN);
+		NodeId cond_node = expr();
+		expect(TK_RPAREN);
+		NodeId while_node = new_node(ND_WHILE, cond_node, stmt());
+		nodes[while_node].label_num = label_num++;
 		return while_node;
-	} else if (consume_kw(TK_FOR)) {
-		expect("(");
-		Node *init_node = NULL;
-		if (!consume(";")) {
+	} else if (consume(TK_FOR)) {
+		expect(TK_LPAREN);
+		NodeId init_node = 0;
+		if (!consume(TK_SEMI)) {
 			init_node = expr();
-			expect(";");
+			expect(TK_SEMI);
 		}
-		Node *cond_node = NULL;
-		if (!consume(";")) {
+		NodeId cond_node = 0;
+		if (!consume(TK_SEMI)) {
 			cond_node = expr();
-			expect(";");
+			expect(TK_SEMI);
 		}
-		Node *increment_node = NULL;
-		if (!consume(")")) {
+		NodeId increment_node = 0;
+		if (!consume(TK_RPAREN)) {
 			increment_node = expr();
-			expect(")");
+			expect(TK_RPAREN);
 		}
-		Node *for_node = new_node_for(init_node, cond_node, increment_node, stmt());
-		for_node->label_num = label_num++;
+		NodeId for_node = new_node_for(init_node, cond_node, increment_node, stmt());
+		nodes[for_node].label_num = label_num++;
 		return for_node;
-	} else if (consume_kw(TK_BREAK)) {
-		Node *node = new_node(ND_BREAK, NULL, NULL);
-		expect(";");
+	} else if (consume(TK_BREAK)) {
+		NodeId node = new_node(ND_BREAK, 0, 0);
+		expect(TK_SEMI);
 		return node;
-	} else if (consume("{")) {
-		Node head;
-		head.next = NULL;
-		Node *stmt_node = &head;
-		while(!consume("}")) {
-			stmt_node->next = stmt();
-			stmt_node = stmt_node->next;
-		}
-		return new_node(ND_BLOCK, head.next, NULL);
-	} else if (consume_kw(TK_INT)) {
-		while (consume("*"));
+	} else if (consume(TK_LBRACE)) {
+		enter_scope();
+		int mark = num_node_stack;
+		while(!consume(TK_RBRACE)) {
+			push_node(stmt());
+		}
+		leave_scope();
+		return new_node_list(ND_BLOCK, mark);
+	} else if (consume(TK_INT)) {
+		while (consume(TK_STAR));
 		
-		Token *id_tok = consume_ident();
-		if (!id_tok) {
-			error("expected an identifier");
+		int id_tok = consume_ident();
+		if (id_tok < 0) {
+			error_at(tok_str(token), "expected an identifier");
 		}
 
-		Node *node = calloc(1, sizeof(Node));
-		node->kind = ND_LVAR;
-
-		LVar *lvar = find_lvar(func_id, id_tok);
-		if (lvar) {
-			node->offset = lvar->offset;
-		} else {
-			lvar = calloc(1, sizeof(LVar));
-			lvar->next = locals[func_id];
-			lvar->name = id_tok->str;
-			lvar->len = id_tok->len;
-			if (locals[func_id]) {
-				lvar->offset = locals[func_id]->offset + 8;
-			} else {
-				lvar->offset = 8;
-			}
-			locals[func_id] = lvar;
-			node->offset = lvar->offset;
-		}
-		expect(";");
+		NodeId node = new_node(ND_LVAR, 0, 0);
+		nodes[node].offset = declare_lvar(id_tok)->offset;
+		expect(TK_SEMI);
 		return node;
 	}
 	
-	Node *node = expr();
-	expect(";");
-	return node;
-}
-
-// expr = equality
-Node *expr() {
-	return assign();
-}
-
-// assign = equality ("=" assign)?
-Node *assign() {
-	Node *node = equality();
-
-	if (consume("=")) {
-		node = new_node(ND_ASSIGN, node, assign());
-	}
+	NodeId node = expr();
+	expect(TK_SEMI);
 	return node;
 }
 
-// equality = relational ("==" relational | "!=" relational)*
-Node *equality() {
-	Node *node = relational();
+// BinaryOp describes a token as a binary operator.
+typedef struct {
+	unsigned char prec; // how tightly the operator binds, or 0 if the token isn't an operator
+	unsigned char kind; // the kind of the node made of the operator
+	bool swap;          // whether the operands are swapped, as a > b is made as b < a
+} BinaryOp;
 
-	for (;;) {
-		if (consume("==")) {
-			node = new_node(ND_EQ, node, relational());
-		} else if (consume("!=")) {
-			node = new_node(ND_NE, node, relational());
-		} else {
-			return node;
-		}
-	}
-}
+// binary_ops is indexed by the kind of a token, so that the parser finds an operator and its
+// precedence with one lookup instead of trying each level of the grammar in turn.
+BinaryOp binary_ops[TK_EOF + 1] = {
+	[TK_ASSIGN] = {1, ND_ASSIGN},
+	[TK_EQ] = {2, ND_EQ},
+	[TK_NE] = {2, ND_NE},
+	[TK_LT] = {3, ND_LT},
+	[TK_LE] = {3, ND_LE},
+	[TK_GT] = {3, ND_LT, true},
+	[TK_GE] = {3, ND_LE, true},
+	[TK_PLUS] = {4, ND_ADD},
+	[TK_MINUS] = {4, ND_SUB},
+	[TK_STAR] = {5, ND_MUL},
+	[TK_SLASH] = {5, ND_DIV},
+};
 
+// expr       = assign
+// assign     = equality ("=" assign)?
+// equality   = relational ("==" relational | "!=" relational)*
 // relational = add ("<" add | "<=" add | ">" add | ">=" add)*
-Node *relational() {
-	Node *node = add();
-
-	for (;;) {
-		if (consume("<")) {
-			node = new_node(ND_LT, node, add());
-		} else if (consume("<=")) {
-			node = new_node(ND_LE, node, add());
-		} else if (consume(">")) {
-			node = new_node(ND_LT, add(), node);
-		} else if (consume(">=")) {
-			node = new_node(ND_LE, add(), node);
-		} else {
-			return node;
-		}
-	}
+// add        = mul ("+" mul | "-" mul)*
+// mul        = unary ("*" unary | "/" unary)*
+NodeId expr() {
+	return binary(1);
 }
 
-// add = mul ("+" mul | "-" mul)*
-Node *add() {
-	Node *node = mul();
+// binary parses the levels of the grammar from assign to mul by precedence climbing. It parses
+// an expression whose operators bind at least as tightly as min_prec.
+NodeId binary(int min_prec) {
+	NodeId node = unary();
 
 	for (;;) {
-		if (consume("+")) {
-			node = new_node(ND_ADD, node, mul());
-		} else if (consume("-")) {
-			node = new_node(ND_SUB, node, mul());
-		} else {
+		BinaryOp op = binary_ops[tokens.kinds[token]];
+		if (op.prec < min_prec) {
 			return node;
 		}
-	}
-}
+		token++;
 
-// mul = primary ("*" unary | "/" unary)*
-Node *mul() {
-	Node *node = unary();
-
-	for (;;) {
-		if (consume("*")) {
-			node = new_node(ND_MUL, node, unary());
-		} else if (consume("/")) {
-			node = new_node(ND_DIV, node, unary());
-		} else {
-			return node;
-		}
+		// The right operand of "=" may be another assignment, as "=" is right-associative.
+		// The other operators are left-associative.
+		NodeId rhs = binary(op.kind == ND_ASSIGN ? op.prec : op.prec + 1);
+		node = op.swap ? new_node(op.kind, rhs, node) : new_node(op.kind, node, rhs);
 	}
 }
 
 // unary = ("+" | "-" | "&" | "*")? unary
 //       | primary
-Node *unary() {
-	if (consume("+")) {
+NodeId unary() {
+	switch (tokens.kinds[token]) {
+	case TK_PLUS:
+		token++;
 		return unary();
-	}
-	if (consume("-")) {
+	case TK_MINUS:
+		token++;
 		return new_node(ND_SUB, new_node_num(0), unary());
+	case TK_AMP:
+		token++;
+		return new_node(ND_ADDR, unary(), 0);
+	case TK_STAR:
+		token++;
+		return new_node(ND_DEREF, unary(), 0);
+	default:
+		return primary();
 	}
-	if (consume("&")) {
-		return new_node(ND_ADDR, unary(), NULL);
-	}
-	if (consume("*")) {
-		return new_node(ND_DEREF, unary(), NULL);
-	}
-	return primary();
 }
 
 // primary = "(" expr ")"
 //         | ident ("(" (expr ("," expr)*)? ")")?
 //         | num
-Node *primary() {
-	if (consume("(")) {
-		Node *node = expr();
-		expect(")");
+NodeId primary() {
+	if (consume(TK_LPAREN)) {
+		NodeId node = expr();
+		expect(TK_RPAREN);
 		return node;
 	}
 
-	Token *tok = consume_ident();
-	if (tok) {
-		if (consume("(")) {
-			Node params;
-			params.next = NULL;
-			Node *p = &params;
-			while (!consume(")")) {
-				p->next = expr();
-				p = p->next;
-				if (consume(")")) {
+	int tok = consume_ident();
+	if (tok >= 0) {
+		if (consume(TK_LPAREN)) {
+			int mark = num_node_stack;
+			while (!consume(TK_RPAREN)) {
+				push_node(expr());
+				if (consume(TK_RPAREN)) {
 					break;
 				}
-				expect(",");
+				expect(TK_COMMA);
 			};
-			char *func_name = calloc(tok->len + 1, sizeof(char));
-			memcpy(func_name, tok->str, tok->len);
-			func_name[tok->len] = '\0';
-			return new_node_funccall(func_name, params.next);
+			return new_node_funccall(tokens.vals[tok], mark);
 		}
 
-		LVar *lvar = find_lvar(func_id, tok);
+		LVar *lvar = find_lvar(tok);
 		if (!lvar) {
-			char var[256];
-			memcpy(var, tok->str, tok->len);
-			var[tok->len] = '\0';
-			error("use of undefined variable: %s", var);
+			error_at(tok_str(tok), "use of undefined variable: %.*s", tokens.lens[tok], tok_str(tok));
 		}
 
-		Node *node = calloc(1, sizeof(Node));
-		node->kind = ND_LVAR;
-		node->offset = lvar->offset;
-
+		NodeId node = new_node(ND_LVAR, 0, 0);
+		nodes[node].offset = lvar->offset;
 		return node;
 	}
 
 	return new_node_num(expect_number());
 }
 
-void gen(Node *node, char *breakLabel);
+// count_nodes returns the number of nodes in a tree.
+int count_nodes(NodeId id) {
+	Node *node = nd(id);
+	if (!node) {
+		return 0;
+	}
+	int n = 1;
+	for (int i = 0; i < num_children(node); i++) {
+		n += count_nodes(child(node, i));
+	}
+	return n;
+}
 
-void gen_lval(Node *node) {
-	switch (node->kind) {
-	case ND_LVAR:
-		printf("  mov rax, rbp\n");
-		printf("  sub rax, %d\n", node->offset);
-		printf("  push rax\n");
-		break;
-	case ND_DEREF:
-		gen(node->lhs, NULL);
+// has_side_effects reports whether evaluating an expression may have side effects.
+bool has_side_effects(NodeId id) {
+	Node *node = nd(id);
+	if (!node) {
+		return false;
+	}
+	if (node->kind == ND_ASSIGN || node->kind == ND_FUNCCALL) {
+		return true;
+	}
+	for (int i = 0; i < num_children(node); i++) {
+		if (has_side_effects(child(node, i))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool is_num(Node *node, int val) {
+	return node->kind == ND_NUM && node->val == val;
+}
+
+// fold_binary evaluates a binary operation over two constants. It returns false when the result
+// can't be computed at compile time or doesn't fit in an integer literal.
+bool fold_binary(NodeKind kind, long long l, long long r, int *val) {
+	long long v;
+	switch (kind) {
+	case ND_EQ: v = l == r; break;
+	case ND_NE: v = l != r; break;
+	case ND_LT: v = l < r; break;
+	case ND_LE: v = l <= r; break;
+	case ND_ADD: v = l + r; break;
+	case ND_SUB: v = l - r; break;
+	case ND_MUL: v = l * r; break;
+	case ND_DIV:
+		if (r == 0) {
+			return false;
+		}
+		v = l / r;
 		break;
 	default:
-		error("left value must be a variable or a dereference");
-		break;
+		return false;
 	}
+	if (v < INT_MIN || v > INT_MAX) {
+		return false;
+	}
+	*val = v;
+	return true;
 }
 
-// gen generates asembly.
-void gen(Node *node, char *breakLabel) {
-	if (node == NULL) {
-		return;
+NodeId fold(NodeId id);
+
+// set_child replaces the i-th child of a node.
+void set_child(NodeId id, int i, NodeId c) {
+	Node *node = &nodes[id];
+	if (has_list(node->kind)) {
+		node_lists[node->lhs + i] = c;
+	} else if (i == 0) {
+		node->lhs = c;
+	} else {
+		node->rhs = c;
 	}
+}
 
-	switch (node->kind) {
-	case ND_NUM:
-		printf("  # number starts\n");
-		printf("  push %d\n", node->val);
-		printf("  # number ends\n");
-		return;
-	case ND_FUNCCALL: {
-		printf("  # calling starts\n");
-		
-		int nth = 1;
-		for (Node *param = node->lhs; param; param = param->next) {
-			gen(param, NULL);
-			switch (nth) {
-			case 1:
-				printf("  pop rdi\n");
-				break;
-			case 2:
-				printf("  pop rsi\n");
-				break;
-			case 3:
-				printf("  pop rdx\n");
-				break;
-			case 4:
-				printf("  pop rcx\n");
-				break;
-			case 5:
-				printf("  pop r8\n");
-				break;
-			case 6:
-				printf("  pop r9\n");
-				break;
-			}
-			nth++;
+// fold_children folds each child of a node. Folding may make nodes, so the node is looked up
+// again after each child.
+void fold_children(NodeId id) {
+	for (int i = 0; i < num_children(&nodes[id]); i++) {
+		NodeId folded = fold(child(&nodes[id], i));
+		set_child(id, i, folded);
+	}
+}
+
+// fold_list folds the children of a node with a list of them and packs the results.
+// Empty blocks are dropped.
+void fold_list(NodeId id) {
+	int len = 0;
+	for (int i = 0; i < nodes[id].rhs; i++) {
+		NodeId folded = fold(node_lists[nodes[id].lhs + i]);
+		if (nodes[folded].kind == ND_BLOCK && nodes[folded].rhs == 0) {
+			continue;
 		}
-		printf("  call %s\n", node->func_name);
-		printf("  push rax\n");
-		printf("  # calling ends\n");
-		return;
+		node_lists[nodes[id].lhs + len++] = folded;
+	}
+	nodes[id].rhs = len;
+}
+
+// fold folds constant subtrees and simplifies algebraic identities of a statement or an expression.
+// Statements whose condition is a known constant are replaced by the branch to be taken.
+// It returns the node to replace `id` with.
+NodeId fold(NodeId id) {
+	if (!id) {
+		return 0;
 	}
+
+	switch (nodes[id].kind) {
+	case ND_NUM:
 	case ND_LVAR:
-		printf("  # lvar starts\n");
-		gen_lval(node);
-		printf("  pop rax\n");
-		printf("  mov rax, [rax]\n");
-		printf("  push rax\n");
-		printf("  # lvar ends\n");
-		return;
-	case ND_ASSIGN:
-		printf("  # assign starts\n");
-		gen_lval(node->lhs);
-		gen(node->rhs, breakLabel);
-		printf("  pop rdi\n");
-		printf("  pop rax\n");
-		printf("  mov [rax], rdi\n");
-		printf("  push rdi\n");
-		printf("  # assign ends\n");
-		return;
+	case ND_BREAK:
+		return id;
+	case ND_FUNCCALL:
+	case ND_BLOCK:
+		fold_list(id);
+		return id;
+	case ND_ASSIGN: {
+		if (nodes[nodes[id].lhs].kind == ND_DEREF) {
+			fold_children(nodes[id].lhs);
+		}
+		NodeId rhs = fold(nodes[id].rhs);
+		nodes[id].rhs = rhs;
+		return id;
+	}
+	}
+
+	fold_children(id);
+	Node *node = &nodes[id];
+	switch (node->kind) {
 	case ND_ADDR:
-		printf("  # address starts\n");
-		gen_lval(node->lhs);
-		printf("  # address ends\n");
-		return;
 	case ND_DEREF:
-		printf("  # dereference starts\n");
-		gen(node->lhs, NULL);
-		printf("  pop rax\n");
-		printf("  mov rax, [rax]\n");
-		printf("  push rax\n");
-		printf("  # dereference ends\n");
-		return;
 	case ND_RETURN:
-		printf("  # return starts\n");
-		gen(node->lhs, breakLabel);
-		printf("  pop rax\n");
-		printf("  mov rsp, rbp\n");
-		printf("  pop rbp\n");
-		printf("  ret\n");
-		printf("  # return ends\n");
-		return;
-	case ND_IF:
-		printf("  # if starts\n");
-		// lhs: condition
-		// rhs: statement to execute when condition is true (if clause)
-		// opt1: statement to execute when condition is false (else clause) (optional)
-		gen(node->lhs, breakLabel);
-		if (node->opt1) {
-			printf("  pop rax\n");
-			printf("  cmp rax, 0\n");
-			printf("  je .Lelse%d\n", node->label_num);
-			gen(node->rhs, breakLabel);
-			printf("  jmp .Lend%d\n", node->label_num);
-			printf(".Lelse%d:\n", node->label_num);
-			gen(node->opt1, breakLabel);
-			printf(".Lend%d:\n", node->label_num);
-		} else {
-			printf("  pop rax\n");
-			printf("  cmp rax, 0\n");
-			printf("  je .Lend%d\n", node->label_num);
-			gen(node->rhs, breakLabel);
-			printf(".Lend%d:\n", node->label_num);
+		return id;
+	case ND_IF: {
+		Node *cond = nd(child(node, 0));
+		if (cond->kind == ND_NUM) {
+			NodeId taken = child(node, cond->val ? 1 : 2);
+			return taken ? taken : new_node(ND_BLOCK, 0, 0);
 		}
-		printf("  # if ends\n");
-		return;
-	case ND_WHILE: {
-		printf("  # while starts\n");
-		
-		char breakLabel[256];
-		sprintf(breakLabel, ".Lend%d", node->label_num);
-		
-		// lhs: condition
-		// rhs: statement to execute when condition is true
-		printf(".Lbegin%d:\n", node->label_num);
-		gen(node->lhs, breakLabel);
-		printf("  pop rax\n");
-		printf("  cmp rax, 0\n");
-		printf("  je %s\n", breakLabel);
-		gen(node->rhs, breakLabel);
-		printf("  jmp .Lbegin%d\n", node->label_num);
-		printf("%s:\n", breakLabel);
-		printf("  # while ends\n");
-		return;
+		return id;
 	}
+	case ND_WHILE:
+		if (is_num(nd(node->lhs), 0)) {
+			return new_node(ND_BLOCK, 0, 0);
+		}
+		if (nd(node->lhs)->kind == ND_NUM) {
+			// An infinite loop is a for statement without condition.
+			int label = node->label_num;
+			NodeId for_node = new_node_for(0, 0, 0, node->rhs);
+			nodes[for_node].label_num = label;
+			return for_node;
+		}
+		return id;
 	case ND_FOR: {
-		printf("  # for starts\n");
-		
-		char breakLabel[256];
-		sprintf(breakLabel, ".Lend%d", node->label_num);
-		
-		// lhs: init (optional)
-		// rhs: condition (optional)
-		// opt1: increment (optional)
-		// opt2: statement to execute when condition is true
-		gen(node->lhs, breakLabel);
-		printf(".Lbegin%d:\n", node->label_num);
-		if (node->rhs) {
-			gen(node->rhs, breakLabel);
-			printf("  pop rax\n");
-			printf("  cmp rax, 0\n");
-			printf("  je %s\n", breakLabel);
-		}
-		gen(node->opt2, breakLabel);
-		gen(node->opt1, breakLabel);
-		printf("  jmp .Lbegin%d\n", node->label_num);
-		// If the condition expression is missing, it seems that this label isn't required.
-		// But when the break statement is used in this for statement, this label is required to break from it.
-		printf("%s:\n", breakLabel);
-		printf("  # for ends\n");
-		return;
-	}
-	case ND_BREAK:
-		printf("  # break starts\n");
-		
-		if (breakLabel == NULL || strlen(breakLabel) <= 0) {
-			error("`break` can only be used in for or while statement.");
+		NodeId init = child(node, 0);
+		Node *cond = nd(child(node, 1));
+		if (cond && is_num(cond, 0)) {
+			return init ? init : new_node(ND_BLOCK, 0, 0);
 		}
-		printf("  jmp %s\n", breakLabel);
-		printf("  # break ends\n");
-		return;
-	case ND_BLOCK:
-		printf("  # block starts\n");
-		
-		// lhs: list of statements
-		for (Node *stmt = node->lhs; stmt; stmt = stmt->next) {
-			gen(stmt, breakLabel);
-			// If `node` is an expression, discards its result.
-			if (is_expr_node(stmt->kind)) {
-				printf("  pop rax\n");
-			}
+		if (cond && cond->kind == ND_NUM) {
+			set_child(id, 1, 0);
 		}
-		printf("  # block ends\n");
-		return;
+		return id;
+	}
 	}
 
-	gen(node->lhs, NULL);
-	gen(node->rhs, NULL);
+	// binary operators
+	Node *lhs = nd(node->lhs);
+	Node *rhs = nd(node->rhs);
 
-	printf("  pop rdi\n");
-	printf("  pop rax\n");
+	int val;
+	if (lhs->kind == ND_NUM && rhs->kind == ND_NUM && fold_binary(node->kind, lhs->val, rhs->val, &val)) {
+		return new_node_num(val);
+	}
 
 	switch (node->kind) {
-	case ND_EQ:
-		printf("  cmp rax, rdi\n");
-		printf("  sete al\n");
-		printf("  movzb rax, al\n");
-		break;
-	case ND_NE:
-		printf("  cmp rax, rdi\n");
-		printf("  setne al\n");
-		printf("  movzb rax, al\n");
-		break;
-	case ND_LT:
-		printf("  cmp rax, rdi\n");
-		printf("  setl al\n");
-		printf("  movzb rax, al\n");
-		break;
-	case ND_LE:
-		printf("  cmp rax, rdi\n");
-		printf("  setle al\n");
-		printf("  movzb rax, al\n");
-		break;
 	case ND_ADD:
-		printf("  add rax, rdi\n");
+		if (is_num(rhs, 0)) {
+			return node->lhs;
+		}
+		if (is_num(lhs, 0)) {
+			return node->rhs;
+		}
 		break;
 	case ND_SUB:
-		printf("  sub rax, rdi\n");
+		if (is_num(rhs, 0)) {
+			return node->lhs;
+		}
+		// 0-(0-x) => x
+		if (is_num(lhs, 0) && rhs->kind == ND_SUB && is_num(nd(rhs->lhs), 0)) {
+			return rhs->rhs;
+		}
 		break;
 	case ND_MUL:
-		printf("  imul rax, rdi\n");
+		if (is_num(rhs, 1)) {
+			return node->lhs;
+		}
+		if (is_num(lhs, 1)) {
+			return node->rhs;
+		}
+		if (is_num(rhs, 0) && !has_side_effects(node->lhs)) {
+			return node->rhs;
+		}
+		if (is_num(lhs, 0) && !has_side_effects(node->rhs)) {
+			return node->lhs;
+		}
 		break;
 	case ND_DIV:
-		printf("  cqo\n");
-		printf("  idiv rax, rdi\n");
+		if (is_num(rhs, 1)) {
+			return node->lhs;
+		}
 		break;
 	}
+	return id;
+}
 
-	printf("  push rax\n");
+// fold_program folds all functions and returns the number of eliminated nodes.
+int fold_program() {
+	int eliminated = 0;
+	for (int i = 0; i < num_code; i++) {
+		int before = count_nodes(code[i].body);
+		code[i].body = fold(code[i].body);
+		eliminated += before - count_nodes(code[i].body);
+	}
+	return eliminated;
 }
 
-int main(int argc, char **argv) {
-	if (argc != 2) {
-		fprintf(stderr, "n9cc is required 2 parameters");
-		return 1;
+// opt_level is the optimization level specified by -O.
+//   0: stack machine; every temporary goes through push/pop.
+//   1: expression temporaries are allocated to registers.
+int opt_level;
+
+// opt_info is set by -fopt-info to report what the optimizations have done to stderr.
+bool opt_info;
+
+// Reg represents a general purpose register. The values are the register numbers
+// used to encode instructions.
+typedef enum {
+			  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+			  R8, R9, R10, R11, R12, R13, R14, R15,
+			  REG_NONE,
+} Reg;
+
+char *reg_names[] = {
+	"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+	"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+
+// reg8_names are the names of the lowest 8 bits of the registers.
+char *reg8_names[] = {
+	"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+	"r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b",
+};
+
+// CondCode represents a condition code of setcc and jcc.
+typedef enum {
+			  CC_E,  // ==
+			  CC_NE, // !=
+			  CC_L,  // <
+			  CC_LE, // <=
+			  CC_G,  // >
+			  CC_GE, // >=
+} CondCode;
+
+char *cc_names[] = {"e", "ne", "l", "le", "g", "ge"};
+
+// swap_cc returns the condition code that holds for the operands swapped.
+CondCode swap_cc(CondCode cc) {
+	switch (cc) {
+	case CC_L: return CC_G;
+	case CC_LE: return CC_GE;
+	case CC_G: return CC_L;
+	case CC_GE: return CC_LE;
+	default: return cc;
 	}
-	
-	user_input = argv[1];
-	//	printf("# tokenizing start\n");
-	token = tokenize();
-	//	printf("# tokenizing finished\n");
-	//	print_tokens();
-	//	printf("# parsing start\n");
-	program();
-	//	printf("# parsing finished\n");
-	//	print_code(code);
+}
 
-	//	printf("# code generation start\n");
+// invert_cc returns the condition code that holds exactly when cc doesn't.
+CondCode invert_cc(CondCode cc) {
+	switch (cc) {
+	case CC_E: return CC_NE;
+	case CC_NE: return CC_E;
+	case CC_L: return CC_GE;
+	case CC_LE: return CC_G;
+	case CC_G: return CC_LE;
+	case CC_GE: return CC_L;
+	}
+	return cc;
+}
 
-	bool main_found = false;
-	for (int i = 0; code[i]; i++) {
-		Node *node = code[i];
-		if (node->kind != ND_FUNCDEF) {
-			continue;
-		}
-		if (strncmp(node->func_name, "main", 4) == 0) {
-			main_found = true;
-			break;
-		}
+typedef enum {
+			  OPD_NONE,
+			  OPD_REG,   // register
+			  OPD_IMM,   // immediate
+			  OPD_MEM,   // [reg+index*scale+disp]
+			  OPD_LABEL, // local label: .L<name><num>
+			  OPD_SYM,   // symbol
+} OperandKind;
+
+// Operand represents an operand of an instruction.
+typedef struct {
+	OperandKind kind;
+	Reg reg;    // OPD_REG: the register, OPD_MEM: the base register
+	long val;   // OPD_IMM: the value, OPD_MEM: the displacement, OPD_LABEL: the number
+	char *name; // OPD_LABEL: the name, OPD_SYM: the symbol
+	Reg index;  // OPD_MEM: the index register if scale isn't 0
+	int scale;  // OPD_MEM: 1, 2, 4 or 8, or 0 without an index
+} Operand;
+
+Operand opd_none() {
+	return (Operand){OPD_NONE, REG_NONE, 0, NULL};
+}
+
+Operand opd_reg(Reg reg) {
+	return (Operand){OPD_REG, reg, 0, NULL};
+}
+
+Operand opd_imm(long val) {
+	return (Operand){OPD_IMM, REG_NONE, val, NULL};
+}
+
+Operand opd_mem(Reg base, int disp) {
+	return (Operand){OPD_MEM, base, disp, NULL};
+}
+
+// opd_mem_index returns [base+index*scale], which is only used by lea.
+Operand opd_mem_index(Reg base, Reg index, int scale) {
+	return (Operand){OPD_MEM, base, 0, NULL, index, scale};
+}
+
+Operand opd_label(char *name, int num) {
+	return (Operand){OPD_LABEL, REG_NONE, num, name};
+}
+
+Operand opd_sym(char *name) {
+	return (Operand){OPD_SYM, REG_NONE, 0, name};
+}
+
+bool opd_equal(Operand a, Operand b) {
+	if (a.kind != b.kind || a.reg != b.reg || a.val != b.val || a.scale != b.scale) {
+		return false;
 	}
-	if (!main_found) {
-		error("main function is not found");
+	if (a.scale && a.index != b.index) {
+		return false;
 	}
+	if (a.name == b.name) {
+		return true;
+	}
+	return a.name && b.name && !strcmp(a.name, b.name);
+}
+
+bool is_reg(Operand opd, Reg reg) {
+	return opd.kind == OPD_REG && opd.reg == reg;
+}
 
-	printf(".intel_syntax noprefix\n");
+typedef enum {
+			  I_NOP, // deleted by the peephole optimizer
+			  I_COMMENT,
+			  I_LABEL,
+			  I_GLOBAL,
+			  I_PUSH,
+			  I_POP,
+			  I_MOV,
+			  I_LEA,
+			  I_XCHG,
+			  I_ADD,
+			  I_SUB,
+			  I_IMUL,  // imul <dst>, <src>, or imul <dst> for rdx:rax = rax * dst
+			  I_SHL,
+			  I_SAR,
+			  I_SHR,
+			  I_NEG,
+			  I_CQO,
+			  I_IDIV,
+			  I_CMP,
+			  I_SETCC, // set<cc> <dst 8 bits>
+			  I_MOVZB, // movzb <dst>, <src 8 bits>
+			  I_JMP,
+			  I_JCC,
+			  I_CALL,
+			  I_RET,
+} InsKind;
 
-	for (int i = 0; code[i]; i++) {
-		Node *node = code[i];
-		if (node->kind != ND_FUNCDEF) {
-			continue;
-		}
+char *ins_names[] = {
+	"nop", "#", "", ".global", "push", "pop", "mov", "lea", "xchg", "add", "sub", "imul",
+	"shl", "sar", "shr", "neg", "cqo", "idiv", "cmp", "set", "movzb", "jmp", "j", "call", "ret",
+};
 
-		printf(".global %s\n", node->func_name);
-		printf("%s:\n", node->func_name);
-		printf("  push rbp\n");
-		printf("  mov rbp, rsp\n");
+// Ins represents an instruction, a label or a comment of the generated assembly.
+typedef struct {
+	InsKind kind;
+	CondCode cc; // I_SETCC and I_JCC
+	Operand dst;
+	Operand src;
+} Ins;
 
-		if (locals[node->func_id]) {
-			printf("  sub rsp, %d\n", locals[node->func_id]->offset);
-		}
+// The state of the code generator is thread-local, so that worker threads can generate
+// functions in parallel with -j.
 
-		int nth = 1;
-		for (Node *arg = node->lhs; arg; arg = arg->next) {
-			gen_lval(arg);
-			printf("  pop rax\n");
-			
-			switch (nth) {
-			case 1:
-				printf("  mov [rax], rdi\n");
-				break;
-			case 2:
-				printf("  mov [rax], rsi\n");
-				break;
-			case 3:
-				printf("  mov [rax], rdx\n");
-				break;
-			case 4:
-				printf("  mov [rax], rcx\n");
-				break;
-			case 5:
-				printf("  mov [rax], r8\n");
-				break;
-			case 6:
-				printf("  mov [rax], r9\n");
-				break;
-			}
-			nth++;
-		}
+// insns is the instructions of the function being generated.
+_Thread_local Ins *insns;
+_Thread_local int num_insns;
+_Thread_local int cap_insns;
 
-		gen(node->rhs, NULL);
+// label_func is the id of the function being generated, which qualifies its labels.
+_Thread_local int label_func;
 
-		printf("  mov rsp, rbp\n");
-		printf("  pop rbp\n");
-		printf("  ret\n");
+void emit(InsKind kind, CondCode cc, Operand dst, Operand src) {
+	if (num_insns == cap_insns) {
+		cap_insns = cap_insns ? cap_insns * 2 : 1024;
+		insns = realloc(insns, cap_insns * sizeof(Ins));
 	}
+	insns[num_insns++] = (Ins){kind, cc, dst, src};
+}
+
+void emit0(InsKind kind) {
+	emit(kind, CC_E, opd_none(), opd_none());
+}
+
+void emit1(InsKind kind, Operand dst) {
+	emit(kind, CC_E, dst, opd_none());
+}
 
-	//	printf("# code generation finished\n");
+void emit2(InsKind kind, Operand dst, Operand src) {
+	emit(kind, CC_E, dst, src);
+}
+
+// annotate is cleared by --no-annotate to omit comments from the assembly.
+bool annotate = true;
+
+// comment emits a comment line, which annotates the assembly for human readers.
+void comment(char *text) {
+	if (!annotate) {
+		return;
+	}
+	emit1(I_COMMENT, opd_sym(text));
+}
+
+// The assembly is accumulated in out_buf and written to stdout at once by out_flush,
+// which avoids the cost of formatting and locking of stdio for each line.
+// Each worker thread has its own buffer.
+_Thread_local char *out_buf;
+_Thread_local size_t out_len;
+_Thread_local size_t out_cap;
+
+// out_reserve makes room for n more bytes in out_buf.
+void out_reserve(size_t n) {
+	if (out_len + n <= out_cap) {
+		return;
+	}
+	while (out_len + n > out_cap) {
+		out_cap = out_cap ? out_cap * 2 : 1 << 20;
+	}
+	out_buf = realloc(out_buf, out_cap);
+	if (!out_buf) {
+		error("out of memory");
+	}
+}
+
+void out_mem(char *s, size_t len) {
+	out_reserve(len);
+	memcpy(out_buf + out_len, s, len);
+	out_len += len;
+}
+
+void out_str(char *s) {
+	out_mem(s, strlen(s));
+}
+
+void out_char(char c) {
+	out_reserve(1);
+	out_buf[out_len++] = c;
+}
+
+// out_int writes an integer in decimal.
+void out_int(long val) {
+	char digits[24];
+	int n = 0;
+	unsigned long v = val < 0 ? -(unsigned long)val : val;
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+
+	out_reserve(n + 1);
+	if (val < 0) {
+		out_buf[out_len++] = '-';
+	}
+	while (n > 0) {
+		out_buf[out_len++] = digits[--n];
+	}
+}
+
+// out_fd is where out_flush writes: stdout, or the file given by -o.
+int out_fd = STDOUT_FILENO;
+
+// out_flush writes the buffered output to out_fd.
+void out_flush() {
+	size_t written = 0;
+	while (written < out_len) {
+		ssize_t n = write(out_fd, out_buf + written, out_len - written);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			error("failed to write the output: %s", strerror(errno));
+		}
+		written += n;
+	}
+	out_len = 0;
+}
+
+// out_operand writes an operand in the Intel syntax.
+void out_operand(Operand opd, bool byte) {
+	switch (opd.kind) {
+	case OPD_NONE:
+		break;
+	case OPD_REG:
+		out_str(byte ? reg8_names[opd.reg] : reg_names[opd.reg]);
+		break;
+	case OPD_IMM:
+		out_int(opd.val);
+		break;
+	case OPD_MEM:
+		out_char('[');
+		out_str(reg_names[opd.reg]);
+		if (opd.scale) {
+			out_char('+');
+			out_str(reg_names[opd.index]);
+			out_char('*');
+			out_int(opd.scale);
+		}
+		if (opd.val > 0) {
+			out_char('+');
+		}
+		if (opd.val) {
+			out_int(opd.val);
+		}
+		out_char(']');
+		break;
+	case OPD_LABEL:
+		out_str(".L");
+		out_str(opd.name);
+		out_int(label_func);
+		out_char('_');
+		out_int(opd.val);
+		break;
+	case OPD_SYM:
+		out_str(opd.name);
+		break;
+	}
+}
+
+// out_ins writes an instruction in the Intel syntax.
+void out_ins(Ins *ins) {
+	switch (ins->kind) {
+	case I_NOP:
+		return;
+	case I_COMMENT:
+		out_str("  # ");
+		out_str(ins->dst.name);
+		out_char('\n');
+		return;
+	case I_LABEL:
+		out_operand(ins->dst, false);
+		out_str(":\n");
+		return;
+	case I_SETCC:
+		out_str("  set");
+		out_str(cc_names[ins->cc]);
+		out_char(' ');
+		out_operand(ins->dst, true);
+		out_char('\n');
+		return;
+	case I_JCC:
+		out_str("  j");
+		out_str(cc_names[ins->cc]);
+		out_char(' ');
+		out_operand(ins->dst, false);
+		out_char('\n');
+		return;
+	case I_GLOBAL:
+		out_str(".global ");
+		out_operand(ins->dst, false);
+		out_char('\n');
+		return;
+	}
+
+	out_str("  ");
+	out_str(ins_names[ins->kind]);
+	if (ins->dst.kind != OPD_NONE) {
+		out_char(' ');
+		out_operand(ins->dst, false);
+	}
+	if (ins->src.kind != OPD_NONE) {
+		out_str(", ");
+		out_operand(ins->src, ins->kind == I_MOVZB);
+	}
+	out_char('\n');
+}
+
+// emit_object is set by -c to write an ELF relocatable object instead of the assembly.
+// The instructions are then encoded into out_buf as machine code.
+bool emit_object;
+
+// cc_codes are the encodings of the condition codes, added to the opcodes of setcc and jcc.
+int cc_codes[] = {0x4, 0x5, 0xc, 0xe, 0xf, 0xd};
+
+// LabelDef is the offset of a local label in out_buf. The labels are numbered per function,
+// so the entries of a function are told from stale ones by the id of the function.
+typedef struct {
+	char *name;
+	int num;
+	int func;
+	size_t offset;
+} LabelDef;
+
+// label_defs is an open addressing hash table of the labels of the function being encoded.
+_Thread_local LabelDef *label_defs;
+_Thread_local int label_defs_cap;
+_Thread_local int label_defs_count;
+
+// Fixup is the rel32 of a jump to a local label, which is patched when the function is done.
+typedef struct {
+	size_t at;
+	Operand label;
+} Fixup;
+
+_Thread_local Fixup *fixups;
+_Thread_local int num_fixups;
+_Thread_local int cap_fixups;
+
+// SymRef is a definition of a function or a call to one at an offset in out_buf. It becomes
+// a symbol or a relocation of the object.
+typedef struct {
+	size_t offset;
+	char *name; // interned
+	bool is_def;
+} SymRef;
+
+_Thread_local SymRef *sym_refs;
+_Thread_local int num_sym_refs;
+_Thread_local int cap_sym_refs;
+
+void add_sym_ref(char *name, bool is_def) {
+	if (num_sym_refs == cap_sym_refs) {
+		cap_sym_refs = cap_sym_refs ? cap_sym_refs * 2 : 256;
+		sym_refs = realloc(sym_refs, cap_sym_refs * sizeof(SymRef));
+	}
+	sym_refs[num_sym_refs++] = (SymRef){out_len, name, is_def};
+}
+
+// find_label_def returns the entry of the table for a label of the function being encoded.
+// If the label isn't in the table, it returns the empty entry to put the label in.
+LabelDef *find_label_def(char *name, int num) {
+	unsigned h = hash_string(name, strlen(name)) ^ (unsigned)num * 0x9E3779B1u;
+	for (int i = h & (label_defs_cap - 1);; i = (i + 1) & (label_defs_cap - 1)) {
+		LabelDef *def = &label_defs[i];
+		if (def->func != label_func || !def->name) {
+			return def;
+		}
+		if (def->num == num && !strcmp(def->name, name)) {
+			return def;
+		}
+	}
+}
+
+void define_label(Operand label) {
+	if ((label_defs_count + 1) * 2 > label_defs_cap) {
+		int old_cap = label_defs_cap;
+		LabelDef *old = label_defs;
+		label_defs_cap = old_cap ? old_cap * 2 : 256;
+		label_defs = calloc(label_defs_cap, sizeof(LabelDef));
+		for (int i = 0; i < old_cap; i++) {
+			if (old[i].name && old[i].func == label_func) {
+				*find_label_def(old[i].name, old[i].num) = old[i];
+			}
+		}
+		free(old);
+	}
+	*find_label_def(label.name, label.val) = (LabelDef){label.name, label.val, label_func, out_len};
+	label_defs_count++;
+}
+
+void out_u32(unsigned v) {
+	out_reserve(4);
+	memcpy(out_buf + out_len, &v, 4);
+	out_len += 4;
+}
+
+bool fits_int8(long v) {
+	return -128 <= v && v <= 127;
+}
+
+bool fits_int32(long v) {
+	return INT_MIN <= v && v <= INT_MAX;
+}
+
+// encode_rm encodes an instruction with a ModRM byte: the optional REX prefix, the opcode,
+// which is 0x0f-prefixed if it's larger than a byte, ModRM, SIB and the displacement.
+// reg is a register or the opcode extension. w selects the 64-bit operand size, and byte
+// means that a register in rm is accessed as 8 bits.
+void encode_rm(int opcode, int reg, Operand rm, bool w, bool byte) {
+	if (rm.kind != OPD_REG && rm.kind != OPD_MEM) {
+		error("cannot encode an operand of kind %d", rm.kind);
+	}
+	bool sib = rm.kind == OPD_MEM && (rm.scale || (rm.reg & 7) == RSP);
+	int index = rm.kind == OPD_MEM && rm.scale ? rm.index : RSP; // rsp as the index means none
+	int rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (rm.reg >> 3);
+	if (rex != 0x40 || (byte && rm.kind == OPD_REG && rm.reg >= RSP)) {
+		out_char(rex);
+	}
+	if (opcode > 0xff) {
+		out_char(opcode >> 8);
+	}
+	out_char(opcode);
+
+	if (rm.kind == OPD_REG) {
+		out_char(0xc0 | (reg & 7) << 3 | (rm.reg & 7));
+		return;
+	}
+	// [rbp] and [r13] have no encoding without a displacement.
+	int mod = 2;
+	if (rm.val == 0 && (rm.reg & 7) != RBP) {
+		mod = 0;
+	} else if (fits_int8(rm.val)) {
+		mod = 1;
+	}
+	// An index, and [rsp] and [r12], need a SIB byte.
+	out_char(mod << 6 | (reg & 7) << 3 | (sib ? RSP : rm.reg & 7));
+	if (sib) {
+		int scale_bits = rm.scale == 8 ? 3 : rm.scale == 4 ? 2 : rm.scale == 2 ? 1 : 0;
+		out_char(scale_bits << 6 | (index & 7) << 3 | (rm.reg & 7));
+	}
+	if (mod == 1) {
+		out_char(rm.val);
+	} else if (mod == 2) {
+		out_u32(rm.val);
+	}
+}
+
+// encode_imm encodes an immediate of an instruction with the 8-bit form op8 and the 32-bit
+// form op32 for a ModRM byte with the extension ext, such as `add r/m, imm`.
+void encode_imm(int op8, int op32, int ext, Operand dst, long imm) {
+	if (fits_int8(imm)) {
+		encode_rm(op8, ext, dst, true, false);
+		out_char(imm);
+	} else if (fits_int32(imm)) {
+		encode_rm(op32, ext, dst, true, false);
+		out_u32(imm);
+	} else {
+		error("immediate out of range: %ld", imm);
+	}
+}
+
+// encode_alu encodes a binary operation with the forms `op r/m, r` (op_mr), `op r, r/m` (op_rm)
+// and `op r/m, imm` (the extension ext of 0x81 and 0x83).
+void encode_alu(Ins *ins, int op_mr, int op_rm, int ext) {
+	if (ins->src.kind == OPD_REG) {
+		encode_rm(op_mr, ins->src.reg, ins->dst, true, false);
+	} else if (ins->src.kind == OPD_MEM && ins->dst.kind == OPD_REG) {
+		encode_rm(op_rm, ins->dst.reg, ins->src, true, false);
+	} else if (ins->src.kind == OPD_IMM) {
+		encode_imm(0x83, 0x81, ext, ins->dst, ins->src.val);
+	} else {
+		error("cannot encode %s", ins_names[ins->kind]);
+	}
+}
+
+// encode_rel32 encodes the displacement of a jump to a local label, to be fixed up later.
+void encode_rel32(Operand label) {
+	if (num_fixups == cap_fixups) {
+		cap_fixups = cap_fixups ? cap_fixups * 2 : 256;
+		fixups = realloc(fixups, cap_fixups * sizeof(Fixup));
+	}
+	fixups[num_fixups++] = (Fixup){out_len, label};
+	out_u32(0);
+}
+
+// encode_ins encodes an instruction as machine code.
+void encode_ins(Ins *ins) {
+	Operand dst = ins->dst;
+	Operand src = ins->src;
+
+	switch (ins->kind) {
+	case I_NOP:
+	case I_COMMENT:
+	case I_GLOBAL: // every function is global
+		return;
+	case I_LABEL:
+		if (dst.kind == OPD_SYM) {
+			add_sym_ref(dst.name, true);
+		} else {
+			define_label(dst);
+		}
+		return;
+	case I_PUSH:
+		if (dst.kind == OPD_REG) {
+			if (dst.reg >= R8) {
+				out_char(0x41);
+			}
+			out_char(0x50 + (dst.reg & 7));
+		} else if (dst.kind == OPD_IMM && fits_int8(dst.val)) {
+			out_char(0x6a);
+			out_char(dst.val);
+		} else if (dst.kind == OPD_IMM && fits_int32(dst.val)) {
+			out_char(0x68);
+			out_u32(dst.val);
+		} else {
+			encode_rm(0xff, 6, dst, false, false);
+		}
+		return;
+	case I_POP:
+		if (dst.kind == OPD_REG) {
+			if (dst.reg >= R8) {
+				out_char(0x41);
+			}
+			out_char(0x58 + (dst.reg & 7));
+		} else {
+			encode_rm(0x8f, 0, dst, false, false);
+		}
+		return;
+	case I_MOV:
+		if (src.kind == OPD_IMM && !fits_int32(src.val) && dst.kind == OPD_REG) {
+			// movabs
+			out_char(0x48 | (dst.reg >> 3));
+			out_char(0xb8 + (dst.reg & 7));
+			out_u32(src.val);
+			out_u32(src.val >> 32);
+		} else if (src.kind == OPD_IMM) {
+			encode_rm(0xc7, 0, dst, true, false);
+			out_u32(src.val);
+		} else {
+			encode_alu(ins, 0x89, 0x8b, 0);
+		}
+		return;
+	case I_LEA:
+		encode_rm(0x8d, dst.reg, src, true, false);
+		return;
+	case I_XCHG:
+		encode_rm(0x87, src.reg, dst, true, false);
+		return;
+	case I_ADD:
+		encode_alu(ins, 0x01, 0x03, 0);
+		return;
+	case I_SUB:
+		encode_alu(ins, 0x29, 0x2b, 5);
+		return;
+	case I_CMP:
+		encode_alu(ins, 0x39, 0x3b, 7);
+		return;
+	case I_IMUL:
+		if (src.kind == OPD_IMM) {
+			// imul r, r/m, imm
+			encode_imm(0x6b, 0x69, dst.reg, dst, src.val);
+		} else if (src.kind == OPD_NONE) {
+			encode_rm(0xf7, 5, dst, true, false);
+		} else {
+			encode_rm(0x0faf, dst.reg, src, true, false);
+		}
+		return;
+	case I_SHL:
+	case I_SAR:
+	case I_SHR:
+		// The extensions of `shift r/m, imm8`.
+		encode_rm(0xc1, ins->kind == I_SHL ? 4 : ins->kind == I_SAR ? 7 : 5, dst, true, false);
+		out_char(src.val);
+		return;
+	case I_NEG:
+		encode_rm(0xf7, 3, dst, true, false);
+		return;
+	case I_CQO:
+		out_char(0x48);
+		out_char(0x99);
+		return;
+	case I_IDIV:
+		encode_rm(0xf7, 7, dst, true, false);
+		return;
+	case I_SETCC:
+		encode_rm(0x0f90 + cc_codes[ins->cc], 0, dst, false, true);
+		return;
+	case I_MOVZB:
+		encode_rm(0x0fb6, dst.reg, src, true, true);
+		return;
+	case I_JMP:
+		out_char(0xe9);
+		encode_rel32(dst);
+		return;
+	case I_JCC:
+		out_char(0x0f);
+		out_char(0x80 + cc_codes[ins->cc]);
+		encode_rel32(dst);
+		return;
+	case I_CALL:
+		out_char(0xe8);
+		add_sym_ref(dst.name, false);
+		out_u32(0);
+		return;
+	case I_RET:
+		out_char(0xc3);
+		return;
+	}
+}
+
+// resolve_fixups patches the jumps of the function just encoded with the offsets of their labels.
+void resolve_fixups() {
+	for (int i = 0; i < num_fixups; i++) {
+		Fixup *fixup = &fixups[i];
+		LabelDef *def = label_defs ? find_label_def(fixup->label.name, fixup->label.val) : NULL;
+		if (!def || !def->name) {
+			error("undefined label: .L%s%d_%ld", fixup->label.name, label_func, fixup->label.val);
+		}
+		int rel = def->offset - (fixup->at + 4);
+		memcpy(out_buf + fixup->at, &rel, 4);
+	}
+	num_fixups = 0;
+	label_defs_count = 0;
+}
+
+// loop_rotate is set by -floop-rotate, and by default at -O1, to lay out loops with the
+// condition at the bottom. -fno-loop-rotate clears it.
+int loop_rotate = -1;
+
+// peephole_window is the maximum number of instructions a peephole rule may look at.
+// Rules matching longer sequences are disabled. 0 disables the peephole optimizer.
+int peephole_window = -1;
+
+// PeepholeRule is a rewriting rule of the peephole optimizer. apply receives the indices of
+// the next `len` instructions, skipping comments and deleted instructions, and returns true
+// if it rewrote them.
+typedef struct {
+	char *name;
+	int len;
+	bool (*apply)(int *at);
+} PeepholeRule;
+
+// push X; pop X => (nothing)
+bool peep_push_pop_same(int *at) {
+	Ins *push = &insns[at[0]];
+	Ins *pop = &insns[at[1]];
+	if (push->kind != I_PUSH || pop->kind != I_POP || !opd_equal(push->dst, pop->dst)) {
+		return false;
+	}
+	push->kind = I_NOP;
+	pop->kind = I_NOP;
+	return true;
+}
+
+// push X; pop Y => mov Y, X
+bool peep_push_pop(int *at) {
+	Ins *push = &insns[at[0]];
+	Ins *pop = &insns[at[1]];
+	if (push->kind != I_PUSH || pop->kind != I_POP || pop->dst.kind != OPD_REG) {
+		return false;
+	}
+	if (push->dst.kind != OPD_REG && push->dst.kind != OPD_IMM) {
+		return false;
+	}
+	*pop = (Ins){I_MOV, CC_E, pop->dst, push->dst};
+	push->kind = I_NOP;
+	return true;
+}
+
+// mov X, X => (nothing)
+bool peep_self_mov(int *at) {
+	Ins *mov = &insns[at[0]];
+	if (mov->kind != I_MOV || mov->dst.kind != OPD_REG || !opd_equal(mov->dst, mov->src)) {
+		return false;
+	}
+	mov->kind = I_NOP;
+	return true;
+}
+
+// branch_on_setcc rewrites `cmp R, 0; je/jne L`, which tests the value set by setcc and movzb,
+// into a jump on the flags setcc has consumed. setcc and movzb don't affect the flags.
+bool branch_on_setcc(Ins *setcc, Ins *movzb, Reg reg, Ins *cmp, Ins *jcc) {
+	if (setcc->kind != I_SETCC || movzb->kind != I_MOVZB || !is_reg(movzb->src, setcc->dst.reg)) {
+		return false;
+	}
+	if (cmp->kind != I_CMP || !is_reg(cmp->dst, reg) || cmp->src.kind != OPD_IMM || cmp->src.val != 0) {
+		return false;
+	}
+	if (jcc->kind != I_JCC || (jcc->cc != CC_E && jcc->cc != CC_NE)) {
+		return false;
+	}
+	jcc->cc = jcc->cc == CC_E ? invert_cc(setcc->cc) : setcc->cc;
+	cmp->kind = I_NOP;
+	return true;
+}
+
+// setcc al; movzb R, al; cmp R, 0; je L => setcc al; movzb R, al; jn<cc> L
+bool peep_setcc_branch(int *at) {
+	Ins *movzb = &insns[at[1]];
+	return branch_on_setcc(&insns[at[0]], movzb, movzb->dst.reg, &insns[at[2]], &insns[at[3]]);
+}
+
+// setcc al; movzb R, al; mov R2, R; cmp R2, 0; je L => setcc al; movzb R, al; mov R2, R; jn<cc> L
+bool peep_setcc_mov_branch(int *at) {
+	Ins *movzb = &insns[at[1]];
+	Ins *mov = &insns[at[2]];
+	if (mov->kind != I_MOV || mov->dst.kind != OPD_REG || !opd_equal(mov->src, movzb->dst)) {
+		return false;
+	}
+	return branch_on_setcc(&insns[at[0]], movzb, mov->dst.reg, &insns[at[3]], &insns[at[4]]);
+}
+
+// j<cc> L1; jmp L2; L1: => jn<cc> L2; L1:
+bool peep_jcc_over_jmp(int *at) {
+	Ins *jcc = &insns[at[0]];
+	Ins *jmp = &insns[at[1]];
+	Ins *label = &insns[at[2]];
+	if (jcc->kind != I_JCC || jmp->kind != I_JMP || label->kind != I_LABEL || !opd_equal(jcc->dst, label->dst)) {
+		return false;
+	}
+	*jcc = (Ins){I_JCC, invert_cc(jcc->cc), jmp->dst, opd_none()};
+	jmp->kind = I_NOP;
+	return true;
+}
+
+PeepholeRule peephole_rules[] = {
+	{"push-pop-same", 2, peep_push_pop_same},
+	{"push-pop", 2, peep_push_pop},
+	{"self-mov", 1, peep_self_mov},
+	{"setcc-branch", 4, peep_setcc_branch},
+	{"setcc-mov-branch", 5, peep_setcc_mov_branch},
+	{"jcc-over-jmp", 3, peep_jcc_over_jmp},
+};
+#define NUM_PEEPHOLE_RULES (sizeof(peephole_rules) / sizeof(PeepholeRule))
+#define MAX_PEEPHOLE_WINDOW 5
+
+// peep_jmp_next deletes a jump to a label which immediately follows it.
+// Unlike the other rules it looks through labels, so it isn't limited by the window.
+int peep_jmp_next() {
+	int hits = 0;
+	for (int i = 0; i < num_insns; i++) {
+		if (insns[i].kind != I_JMP) {
+			continue;
+		}
+		for (int j = i + 1; j < num_insns; j++) {
+			Ins *ins = &insns[j];
+			if (ins->kind == I_LABEL && opd_equal(ins->dst, insns[i].dst)) {
+				insns[i].kind = I_NOP;
+				hits++;
+				break;
+			}
+			if (ins->kind != I_LABEL && ins->kind != I_COMMENT && ins->kind != I_NOP) {
+				break;
+			}
+		}
+	}
+	return hits;
+}
+
+// peephole_hits counts how many times each rule, and jmp-next at the end, has been applied.
+_Thread_local int peephole_hits[NUM_PEEPHOLE_RULES + 1];
+
+// peephole rewrites the instructions of the function being generated until no rule applies.
+void peephole() {
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (int i = 0; i < num_insns; i++) {
+			// Collect the indices of the instructions in the window, skipping comments and
+			// deleted instructions, which don't affect the program.
+			int at[MAX_PEEPHOLE_WINDOW];
+			int n = 0;
+			for (int j = i; j < num_insns && n < peephole_window && n < MAX_PEEPHOLE_WINDOW; j++) {
+				if (insns[j].kind != I_COMMENT && insns[j].kind != I_NOP) {
+					at[n++] = j;
+				}
+			}
+			if (n == 0 || at[0] != i) {
+				continue;
+			}
+
+			for (int r = 0; r < NUM_PEEPHOLE_RULES; r++) {
+				PeepholeRule *rule = &peephole_rules[r];
+				if (rule->len <= n && rule->apply(at)) {
+					peephole_hits[r]++;
+					changed = true;
+					break;
+				}
+			}
+		}
+
+		int hits = peep_jmp_next();
+		peephole_hits[NUM_PEEPHOLE_RULES] += hits;
+		changed = changed || hits;
+	}
+}
+
+// print_peephole_hits prints how many times each peephole rule has been applied.
+void print_peephole_hits(int *hits) {
+	for (int r = 0; r < NUM_PEEPHOLE_RULES; r++) {
+		fprintf(stderr, "peephole: %s: %d hits\n", peephole_rules[r].name, hits[r]);
+	}
+	fprintf(stderr, "peephole: jmp-next: %d hits\n", hits[NUM_PEEPHOLE_RULES]);
+}
+
+// flush_insns optimizes the instructions of the function being generated and prints them, or
+// encodes them with -c. It returns the number of instructions, not counting labels and comments.
+int flush_insns() {
+	if (peephole_window > 0) {
+		peephole();
+	}
+	int n = 0;
+	for (int i = 0; i < num_insns; i++) {
+		InsKind kind = insns[i].kind;
+		if (kind != I_NOP && kind != I_COMMENT && kind != I_LABEL && kind != I_GLOBAL) {
+			n++;
+		}
+		if (emit_object) {
+			encode_ins(&insns[i]);
+		} else {
+			out_ins(&insns[i]);
+		}
+	}
+	if (emit_object) {
+		resolve_fixups();
+	}
+	num_insns = 0;
+	return n;
+}
+
+// tmp_regs are the registers holding expression temporaries in -O1.
+// The n-th temporary is also the n-th argument register, so the arguments of
+// a function call are already in place when they are evaluated in order.
+// rax is not a temporary; it is used as a scratch register.
+Reg tmp_regs[] = {RDI, RSI, RDX, RCX, R8, R9, R10, R11};
+#define NUM_TMP_REGS 8
+
+// arg_regs are the registers to pass arguments.
+Reg arg_regs[] = {RDI, RSI, RDX, RCX, R8, R9};
+#define NUM_ARG_REGS 6
+
+// promoted_regs are the callee-saved registers local variables are promoted to in -O1.
+Reg promoted_regs[] = {RBX, R12, R13, R14, R15};
+#define NUM_PROMOTED_REGS 5
+
+// These describe the frame of the function being generated.
+// lvar_regs maps the offset / 8 of each local variable to the register it is promoted to,
+// or REG_NONE if the variable lives on the stack. The promoted registers are saved below the
+// local variables, which take up locals_size bytes.
+_Thread_local Reg *lvar_regs;
+_Thread_local int num_saved_regs;
+_Thread_local int locals_size;
+
+// NO_BREAK_LABEL means that `break` isn't allowed.
+#define NO_BREAK_LABEL -1
+
+void gen(Node *node, int breakLabel);
+void gen_expr(Node *node, int depth);
+
+void gen_lval(Node *node) {
+	switch (node->kind) {
+	case ND_LVAR:
+		emit2(I_MOV, opd_reg(RAX), opd_reg(RBP));
+		emit2(I_SUB, opd_reg(RAX), opd_imm(node->offset));
+		emit1(I_PUSH, opd_reg(RAX));
+		break;
+	case ND_DEREF:
+		gen(nd(node->lhs), NO_BREAK_LABEL);
+		break;
+	default:
+		error("left value must be a variable or a dereference");
+		break;
+	}
+}
+
+// binary_reg_need returns the number of registers needed by a binary operation
+// whose operands need l and r registers respectively.
+int binary_reg_need(int l, int r) {
+	if (l == r) {
+		return l + 1;
+	}
+	return l > r ? l : r;
+}
+
+// reg_need returns the number of temporary registers needed to evaluate an expression
+// without spilling (Sethi-Ullman number). The result is cached in the node.
+int reg_need(Node *node) {
+	if (node->reg_need) {
+		return node->reg_need;
+	}
+
+	int need;
+	switch (node->kind) {
+	case ND_NUM:
+	case ND_LVAR:
+		need = 1;
+		break;
+	case ND_FUNCCALL:
+		// A call clobbers all temporaries, so evaluating it first leaves fewer temporaries
+		// to save around it.
+		need = NUM_TMP_REGS;
+		break;
+	case ND_ADDR:
+		need = nd(node->lhs)->kind == ND_DEREF ? reg_need(nd(nd(node->lhs)->lhs)) : 1;
+		break;
+	case ND_DEREF:
+		need = reg_need(nd(node->lhs));
+		break;
+	case ND_ASSIGN:
+		if (nd(node->lhs)->kind == ND_LVAR) {
+			need = reg_need(nd(node->rhs));
+			break;
+		}
+		// An assignment through a pointer needs both the address and the value.
+		need = binary_reg_need(reg_need(nd(node->lhs)->kind == ND_DEREF ? nd(nd(node->lhs)->lhs) : nd(node->lhs)), reg_need(nd(node->rhs)));
+		break;
+	default:
+		need = binary_reg_need(reg_need(nd(node->lhs)), reg_need(nd(node->rhs)));
+		break;
+	}
+
+	node->reg_need = need;
+	return need;
+}
+
+// gen_operands evaluates both operands of a binary operation, the one needing more registers first.
+// The operands are left in the depth-th temporary and either the next temporary or, when the
+// temporaries run out, rax. lreg and rreg receive the registers holding the lhs and the rhs.
+void gen_operands(Node *lhs, Node *rhs, int depth, Reg *lreg, Reg *rreg) {
+	bool lhs_first = reg_need(lhs) >= reg_need(rhs);
+	Node *first = lhs_first ? lhs : rhs;
+	Node *second = lhs_first ? rhs : lhs;
+	Reg dst = tmp_regs[depth];
+
+	gen_expr(first, depth);
+	if (depth + 1 < NUM_TMP_REGS) {
+		gen_expr(second, depth + 1);
+		*lreg = lhs_first ? dst : tmp_regs[depth + 1];
+		*rreg = lhs_first ? tmp_regs[depth + 1] : dst;
+		return;
+	}
+
+	// Spill the first operand while evaluating the second one.
+	emit1(I_PUSH, opd_reg(dst));
+	gen_expr(second, depth);
+	emit1(I_POP, opd_reg(RAX));
+	if (!lhs_first) {
+		emit2(I_XCHG, opd_reg(RAX), opd_reg(dst));
+	}
+	*lreg = RAX;
+	*rreg = dst;
+}
+
+// gen_div generates a signed division lreg / rreg into the depth-th temporary.
+void gen_div(Reg lreg, Reg rreg, int depth) {
+	// rdx is the 3rd temporary and is clobbered by cqo and idiv.
+	bool save_rdx = depth > 2;
+
+	if (lreg != RAX) {
+		emit2(I_MOV, opd_reg(RAX), opd_reg(lreg));
+	}
+	if (rreg == RDX) {
+		// lreg has been copied to rax and is free to hold the divisor.
+		emit2(I_MOV, opd_reg(lreg), opd_reg(RDX));
+		rreg = lreg;
+	}
+	if (save_rdx) {
+		emit1(I_PUSH, opd_reg(RDX));
+	}
+	emit0(I_CQO);
+	emit1(I_IDIV, opd_reg(rreg));
+	if (save_rdx) {
+		emit1(I_POP, opd_reg(RDX));
+	}
+	emit2(I_MOV, opd_reg(tmp_regs[depth]), opd_reg(RAX));
+}
+
+// log2_exact returns k if v is 2^k, or -1.
+int log2_exact(unsigned long v) {
+	if (v == 0 || (v & (v - 1))) {
+		return -1;
+	}
+	int k = 0;
+	while (v > 1) {
+		v >>= 1;
+		k++;
+	}
+	return k;
+}
+
+// MAX_MUL_STEPS is the most shifts and leas a multiplication by a constant is turned into.
+// Each takes a cycle, and imul takes three.
+#define MAX_MUL_STEPS 2
+
+// gen_mul_const generates node * c into the depth-th temporary with shifts and leas, where
+// c = ±3^a*5^b*9^c*2^k, or with imul by an immediate. It returns false if c is too large for
+// an immediate and needs no cheaper sequence.
+bool gen_mul_const(Node *node, long c, int depth) {
+	Reg dst = tmp_regs[depth];
+	unsigned long abs_c = c < 0 ? -(unsigned long)c : c;
+
+	// Factor |c| into leas by 9, 5 and 3 and a shift.
+	int factors[MAX_MUL_STEPS];
+	int num_factors = 0;
+	unsigned long rest = abs_c;
+	for (int f = 9; f >= 3 && rest > 1; f = f == 9 ? 5 : f == 5 ? 3 : 0) {
+		while (rest % f == 0 && num_factors < MAX_MUL_STEPS) {
+			factors[num_factors++] = f;
+			rest /= f;
+		}
+	}
+	int shift = log2_exact(rest);
+	int steps = num_factors + (shift > 0) + (c < 0);
+	bool reduce = c == 0 || (shift >= 0 && steps <= MAX_MUL_STEPS);
+	if (!reduce && !fits_int32(c)) {
+		return false;
+	}
+
+	gen_expr(node, depth);
+	if (c == 0) {
+		emit2(I_MOV, opd_reg(dst), opd_imm(0));
+	} else if (!reduce) {
+		emit2(I_IMUL, opd_reg(dst), opd_imm(c));
+	} else {
+		for (int i = 0; i < num_factors; i++) {
+			emit2(I_LEA, opd_reg(dst), opd_mem_index(dst, dst, factors[i] - 1));
+		}
+		if (shift > 0) {
+			emit2(I_SHL, opd_reg(dst), opd_imm(shift));
+		}
+		if (c < 0) {
+			emit1(I_NEG, opd_reg(dst));
+		}
+	}
+	return true;
+}
+
+// DivMagic is the magic number of a division by a constant d: n / d is the high 64 bits of
+// n * mul, plus n if add is set, shifted right by shift and rounded toward zero.
+typedef struct {
+	long mul;
+	bool add;
+	int shift;
+} DivMagic;
+
+// div_magic computes the magic number of a division by d > 1 which isn't a power of two, with
+// the algorithm of Hacker's Delight, 10-1.
+DivMagic div_magic(unsigned long d) {
+	unsigned long two63 = 1ul << 63;
+	unsigned long anc = two63 - 1 - two63 % d; // the largest n with n % d == d - 1
+	int p = 63;
+	unsigned long q1 = two63 / anc;
+	unsigned long r1 = two63 - q1 * anc;
+	unsigned long q2 = two63 / d;
+	unsigned long r2 = two63 - q2 * d;
+	unsigned long delta;
+	do {
+		p++;
+		q1 *= 2;
+		r1 *= 2;
+		if (r1 >= anc) {
+			q1++;
+			r1 -= anc;
+		}
+		q2 *= 2;
+		r2 *= 2;
+		if (r2 >= d) {
+			q2++;
+			r2 -= d;
+		}
+		delta = d - r2;
+	} while (q1 < delta || (q1 == delta && r1 == 0));
+
+	long mul = q2 + 1;
+	return (DivMagic){mul, mul < 0, p - 64};
+}
+
+// gen_div_const generates node / c for a constant c other than 0 into the depth-th temporary,
+// without idiv. A power of two is a shift of the dividend biased to round toward zero, and the
+// other divisors are a multiplication by their magic numbers.
+void gen_div_const(Node *node, long c, int depth) {
+	Reg dst = tmp_regs[depth];
+	unsigned long abs_c = c < 0 ? -(unsigned long)c : c;
+	int k = log2_exact(abs_c);
+
+	gen_expr(node, depth);
+	if (k == 0) {
+		// Nothing to do but the negation.
+	} else if (k > 0) {
+		// Add 2^k - 1 to a negative dividend: rax = (n >> 63) >>> (64 - k).
+		emit2(I_MOV, opd_reg(RAX), opd_reg(dst));
+		if (k > 1) {
+			emit2(I_SAR, opd_reg(RAX), opd_imm(63));
+		}
+		emit2(I_SHR, opd_reg(RAX), opd_imm(64 - k));
+		emit2(I_ADD, opd_reg(dst), opd_reg(RAX));
+		emit2(I_SAR, opd_reg(dst), opd_imm(k));
+	} else {
+		DivMagic magic = div_magic(abs_c);
+		// rdx is the 3rd temporary and is clobbered by imul.
+		Reg n = dst;
+		if (dst == RDX) {
+			// The temporaries above depth are free.
+			n = tmp_regs[depth + 1];
+			emit2(I_MOV, opd_reg(n), opd_reg(RDX));
+		}
+		bool save_rdx = depth > 2;
+		if (save_rdx) {
+			emit1(I_PUSH, opd_reg(RDX));
+		}
+		emit2(I_MOV, opd_reg(RAX), opd_imm(magic.mul));
+		emit1(I_IMUL, opd_reg(n));
+		if (magic.add) {
+			emit2(I_ADD, opd_reg(RDX), opd_reg(n));
+		}
+		if (magic.shift > 0) {
+			emit2(I_SAR, opd_reg(RDX), opd_imm(magic.shift));
+		}
+		// The quotient is rounded down, so add 1 to a negative one.
+		emit2(I_MOV, opd_reg(RAX), opd_reg(RDX));
+		emit2(I_SHR, opd_reg(RAX), opd_imm(63));
+		emit2(I_ADD, opd_reg(RDX), opd_reg(RAX));
+		if (dst != RDX) {
+			emit2(I_MOV, opd_reg(dst), opd_reg(RDX));
+		}
+		if (save_rdx) {
+			emit1(I_POP, opd_reg(RDX));
+		}
+	}
+	if (c < 0) {
+		emit1(I_NEG, opd_reg(dst));
+	}
+}
+
+// gen_funccall generates a function call for -O1 and leaves the result in the depth-th temporary.
+void gen_funccall(Node *node, int depth) {
+	// Temporaries are caller-saved, so the live ones are kept on the stack across the call.
+	for (int i = 0; i < depth; i++) {
+		emit1(I_PUSH, opd_reg(tmp_regs[i]));
+	}
+
+	if (node->rhs > NUM_ARG_REGS) {
+		error("too many arguments to %s", idents[node->name]);
+	}
+	for (int i = 0; i < node->rhs; i++) {
+		gen_expr(nd(child(node, i)), i);
+	}
+	emit1(I_CALL, opd_sym(idents[node->name]));
+
+	for (int i = depth - 1; i >= 0; i--) {
+		emit1(I_POP, opd_reg(tmp_regs[i]));
+	}
+	emit2(I_MOV, opd_reg(tmp_regs[depth]), opd_reg(RAX));
+}
+
+// lvar_reg returns the register a local variable is promoted to, or REG_NONE if it lives on the stack.
+Reg lvar_reg(Node *node) {
+	if (!lvar_regs) {
+		return REG_NONE;
+	}
+	return lvar_regs[node->offset / 8];
+}
+
+// lvar_opd returns the operand to access a local variable in -O1.
+Operand lvar_opd(Node *node) {
+	if (lvar_reg(node) != REG_NONE) {
+		return opd_reg(lvar_reg(node));
+	}
+	return opd_mem(RBP, -node->offset);
+}
+
+// weigh_lvar_uses walks statements and expressions and adds the weight of each use of local
+// variables to uses, which is indexed by offset / 8. Uses in loops weigh more. A variable whose
+// address is taken escapes and can't live in a register.
+void weigh_lvar_uses(Node *node, int weight, int *uses, bool *escaped) {
+	if (!node) {
+		return;
+	}
+	if (node->kind == ND_LVAR) {
+		uses[node->offset / 8] += weight;
+		return;
+	}
+	if (node->kind == ND_ADDR && nd(node->lhs)->kind == ND_LVAR) {
+		escaped[nd(node->lhs)->offset / 8] = true;
+		return;
+	}
+
+	int body_weight = weight;
+	if ((node->kind == ND_WHILE || node->kind == ND_FOR) && weight < (1 << 20)) {
+		body_weight = weight * 8;
+	}
+	for (int i = 0; i < num_children(node); i++) {
+		// The init of a for statement runs once.
+		weigh_lvar_uses(nd(child(node, i)), node->kind == ND_FOR && i == 0 ? weight : body_weight, uses, escaped);
+	}
+}
+
+// promote_lvars chooses the local variables of a function to keep in callee-saved registers
+// for the whole function: the most heavily used ones whose address is never taken.
+void promote_lvars(Function *func) {
+	num_saved_regs = 0;
+	int num_slots = locals_size / 8 + 1;
+	lvar_regs = calloc(num_slots, sizeof(Reg));
+	for (int i = 0; i < num_slots; i++) {
+		lvar_regs[i] = REG_NONE;
+	}
+
+	int *uses = calloc(num_slots, sizeof(int));
+	bool *escaped = calloc(num_slots, sizeof(bool));
+	for (int i = 0; i < func->num_params; i++) {
+		weigh_lvar_uses(nd(node_lists[func->params + i]), 1, uses, escaped);
+	}
+	weigh_lvar_uses(nd(func->body), 1, uses, escaped);
+
+	while (num_saved_regs < NUM_PROMOTED_REGS) {
+		int best = 0;
+		for (int i = 1; i < num_slots; i++) {
+			if (!escaped[i] && lvar_regs[i] == REG_NONE && uses[i] > uses[best]) {
+				best = i;
+			}
+		}
+		if (best == 0) {
+			break;
+		}
+		lvar_regs[best] = promoted_regs[num_saved_regs++];
+	}
+
+	free(uses);
+	free(escaped);
+}
+
+// saved_reg_opd returns the stack slot the i-th promoted register is saved in.
+Operand saved_reg_opd(int i) {
+	return opd_mem(RBP, -(locals_size + 8 * (i + 1)));
+}
+
+// gen_epilogue restores the callee-saved registers and returns from the function being generated.
+void gen_epilogue() {
+	for (int i = 0; i < num_saved_regs; i++) {
+		emit2(I_MOV, opd_reg(promoted_regs[i]), saved_reg_opd(i));
+	}
+	emit2(I_MOV, opd_reg(RSP), opd_reg(RBP));
+	emit1(I_POP, opd_reg(RBP));
+	emit0(I_RET);
+}
+
+// cmp_cc returns the condition code of a comparison node.
+CondCode cmp_cc(NodeKind kind) {
+	switch (kind) {
+	case ND_EQ: return CC_E;
+	case ND_NE: return CC_NE;
+	case ND_LT: return CC_L;
+	case ND_LE: return CC_LE;
+	}
+	error("not a comparison: %d", kind);
+	return CC_E;
+}
+
+// gen_expr generates an expression for -O1 and leaves its value in the depth-th temporary.
+void gen_expr(Node *node, int depth) {
+	Reg dst = tmp_regs[depth];
+	Reg lreg;
+	Reg rreg;
+
+	switch (node->kind) {
+	case ND_NUM:
+		emit2(I_MOV, opd_reg(dst), opd_imm(node->val));
+		return;
+	case ND_LVAR:
+		emit2(I_MOV, opd_reg(dst), lvar_opd(node));
+		return;
+	case ND_FUNCCALL:
+		gen_funccall(node, depth);
+		return;
+	case ND_ADDR:
+		if (nd(node->lhs)->kind == ND_LVAR) {
+			emit2(I_LEA, opd_reg(dst), opd_mem(RBP, -nd(node->lhs)->offset));
+			return;
+		}
+		if (nd(node->lhs)->kind != ND_DEREF) {
+			error("left value must be a variable or a dereference");
+		}
+		gen_expr(nd(nd(node->lhs)->lhs), depth);
+		return;
+	case ND_DEREF:
+		gen_expr(nd(node->lhs), depth);
+		emit2(I_MOV, opd_reg(dst), opd_mem(dst, 0));
+		return;
+	case ND_ASSIGN:
+		if (nd(node->lhs)->kind == ND_LVAR) {
+			gen_expr(nd(node->rhs), depth);
+			emit2(I_MOV, lvar_opd(nd(node->lhs)), opd_reg(dst));
+			return;
+		}
+		if (nd(node->lhs)->kind != ND_DEREF) {
+			error("left value must be a variable or a dereference");
+		}
+		gen_operands(nd(nd(node->lhs)->lhs), nd(node->rhs), depth, &lreg, &rreg);
+		emit2(I_MOV, opd_mem(lreg, 0), opd_reg(rreg));
+		if (rreg != dst) {
+			emit2(I_MOV, opd_reg(dst), opd_reg(rreg));
+		}
+		return;
+	}
+
+	// Multiplications and divisions by constants are reduced to cheaper instructions.
+	if (node->kind == ND_MUL && nd(node->rhs)->kind == ND_NUM && gen_mul_const(nd(node->lhs), nd(node->rhs)->val, depth)) {
+		return;
+	}
+	if (node->kind == ND_MUL && nd(node->lhs)->kind == ND_NUM && gen_mul_const(nd(node->rhs), nd(node->lhs)->val, depth)) {
+		return;
+	}
+	if (node->kind == ND_DIV && nd(node->rhs)->kind == ND_NUM && nd(node->rhs)->val != 0) {
+		gen_div_const(nd(node->lhs), nd(node->rhs)->val, depth);
+		return;
+	}
+
+	gen_operands(nd(node->lhs), nd(node->rhs), depth, &lreg, &rreg);
+	// The operand register other than dst is free after the operation.
+	Reg other = lreg != dst ? lreg : rreg;
+
+	switch (node->kind) {
+	case ND_EQ:
+	case ND_NE:
+	case ND_LT:
+	case ND_LE:
+		emit2(I_CMP, opd_reg(lreg), opd_reg(rreg));
+		emit(I_SETCC, cmp_cc(node->kind), opd_reg(RAX), opd_none());
+		emit2(I_MOVZB, opd_reg(dst), opd_reg(RAX));
+		break;
+	case ND_ADD:
+		emit2(I_ADD, opd_reg(dst), opd_reg(other));
+		break;
+	case ND_SUB:
+		if (lreg == dst) {
+			emit2(I_SUB, opd_reg(dst), opd_reg(rreg));
+		} else {
+			emit2(I_SUB, opd_reg(lreg), opd_reg(rreg));
+			emit2(I_MOV, opd_reg(dst), opd_reg(lreg));
+		}
+		break;
+	case ND_MUL:
+		emit2(I_IMUL, opd_reg(dst), opd_reg(other));
+		break;
+	case ND_DIV:
+		gen_div(lreg, rreg, depth);
+		break;
+	default:
+		error("unexpected node kind: %d", node->kind);
+	}
+}
+
+// gen_value generates an expression whose value is used by a statement and leaves the value in rax.
+void gen_value(Node *node) {
+	if (opt_level == 0) {
+		gen(node, NO_BREAK_LABEL);
+		emit1(I_POP, opd_reg(RAX));
+		return;
+	}
+
+	gen_expr(node, 0);
+	emit2(I_MOV, opd_reg(RAX), opd_reg(tmp_regs[0]));
+}
+
+// is_cmp returns true if a node is a comparison, whose value is 0 or 1.
+bool is_cmp(Node *node) {
+	return node->kind == ND_EQ || node->kind == ND_NE || node->kind == ND_LT || node->kind == ND_LE;
+}
+
+// gen_cond generates a jump to label taken if the condition is jump_if. At -O1 a comparison
+// sets the flags for the jump itself instead of materializing 0 or 1 and testing it, and a
+// comparison of a comparison with 0 or 1, such as (a < b) == 0, jumps on the inner one.
+void gen_cond(Node *node, bool jump_if, Operand label) {
+	if (opt_level >= 1 && (node->kind == ND_EQ || node->kind == ND_NE)) {
+		Node *inner = is_cmp(nd(node->lhs)) ? nd(node->lhs) : nd(node->rhs);
+		Node *num = inner == nd(node->lhs) ? nd(node->rhs) : nd(node->lhs);
+		if (is_cmp(inner) && (is_num(num, 0) || is_num(num, 1))) {
+			bool same = (node->kind == ND_EQ) == is_num(num, 1);
+			gen_cond(inner, same ? jump_if : !jump_if, label);
+			return;
+		}
+	}
+
+	if (opt_level >= 1 && is_cmp(node)) {
+		CondCode cc = cmp_cc(node->kind);
+		Node *lhs = nd(node->lhs);
+		Node *rhs = nd(node->rhs);
+		if (lhs->kind == ND_NUM && rhs->kind != ND_NUM) {
+			// 3 < x => x > 3
+			lhs = nd(node->rhs);
+			rhs = nd(node->lhs);
+			cc = swap_cc(cc);
+		}
+		// A local variable is compared where it lives, in its register or its stack slot. The
+		// assembly would need the size of a slot compared with an immediate, so it isn't.
+		if (rhs->kind == ND_NUM && lhs->kind == ND_LVAR && lvar_reg(lhs) != REG_NONE) {
+			emit2(I_CMP, lvar_opd(lhs), opd_imm(rhs->val));
+		} else if (rhs->kind == ND_NUM) {
+			gen_expr(lhs, 0);
+			emit2(I_CMP, opd_reg(tmp_regs[0]), opd_imm(rhs->val));
+		} else if (lhs->kind == ND_LVAR && rhs->kind == ND_LVAR && (lvar_reg(lhs) != REG_NONE || lvar_reg(rhs) != REG_NONE)) {
+			emit2(I_CMP, lvar_opd(lhs), lvar_opd(rhs));
+		} else if (lhs->kind == ND_LVAR) {
+			gen_expr(rhs, 0);
+			emit2(I_CMP, lvar_opd(lhs), opd_reg(tmp_regs[0]));
+		} else if (rhs->kind == ND_LVAR) {
+			gen_expr(lhs, 0);
+			emit2(I_CMP, opd_reg(tmp_regs[0]), lvar_opd(rhs));
+		} else {
+			Reg lreg;
+			Reg rreg;
+			gen_operands(lhs, rhs, 0, &lreg, &rreg);
+			emit2(I_CMP, opd_reg(lreg), opd_reg(rreg));
+		}
+		emit(I_JCC, jump_if ? cc : invert_cc(cc), label, opd_none());
+		return;
+	}
+
+	gen_value(node);
+	emit2(I_CMP, opd_reg(RAX), opd_imm(0));
+	emit(I_JCC, jump_if ? CC_NE : CC_E, label, opd_none());
+}
+
+// gen_stmt generates a statement. If the statement is an expression, its result is discarded.
+void gen_stmt(Node *node, int breakLabel) {
+	if (node && is_expr_node(node->kind)) {
+		gen_value(node);
+		return;
+	}
+	gen(node, breakLabel);
+}
+
+// gen generates asembly.
+void gen(Node *node, int breakLabel) {
+	if (node == NULL) {
+		return;
+	}
+
+	switch (node->kind) {
+	case ND_NUM:
+		comment("number starts");
+		emit1(I_PUSH, opd_imm(node->val));
+		comment("number ends");
+		return;
+	case ND_FUNCCALL: {
+		comment("calling starts");
+		
+		// Evaluating an argument may clobber the argument registers,
+		// so all arguments are pushed first and popped into the registers afterwards.
+		int nargs = node->rhs;
+		if (nargs > NUM_ARG_REGS) {
+			error("too many arguments to %s", idents[node->name]);
+		}
+		for (int i = 0; i < nargs; i++) {
+			gen(nd(child(node, i)), NO_BREAK_LABEL);
+		}
+		for (int i = nargs - 1; i >= 0; i--) {
+			emit1(I_POP, opd_reg(arg_regs[i]));
+		}
+		emit1(I_CALL, opd_sym(idents[node->name]));
+		emit1(I_PUSH, opd_reg(RAX));
+		comment("calling ends");
+		return;
+	}
+	case ND_LVAR:
+		comment("lvar starts");
+		gen_lval(node);
+		emit1(I_POP, opd_reg(RAX));
+		emit2(I_MOV, opd_reg(RAX), opd_mem(RAX, 0));
+		emit1(I_PUSH, opd_reg(RAX));
+		comment("lvar ends");
+		return;
+	case ND_ASSIGN:
+		comment("assign starts");
+		gen_lval(nd(node->lhs));
+		gen(nd(node->rhs), breakLabel);
+		emit1(I_POP, opd_reg(RDI));
+		emit1(I_POP, opd_reg(RAX));
+		emit2(I_MOV, opd_mem(RAX, 0), opd_reg(RDI));
+		emit1(I_PUSH, opd_reg(RDI));
+		comment("assign ends");
+		return;
+	case ND_ADDR:
+		comment("address starts");
+		gen_lval(nd(node->lhs));
+		comment("address ends");
+		return;
+	case ND_DEREF:
+		comment("dereference starts");
+		gen(nd(node->lhs), NO_BREAK_LABEL);
+		emit1(I_POP, opd_reg(RAX));
+		emit2(I_MOV, opd_reg(RAX), opd_mem(RAX, 0));
+		emit1(I_PUSH, opd_reg(RAX));
+		comment("dereference ends");
+		return;
+	case ND_RETURN:
+		comment("return starts");
+		gen_value(nd(node->lhs));
+		gen_epilogue();
+		comment("return ends");
+		return;
+	case ND_IF: {
+		comment("if starts");
+		Node *cond = nd(child(node, 0));
+		Node *then = nd(child(node, 1));
+		Node *els = nd(child(node, 2)); // optional
+		if (els) {
+			gen_cond(cond, false, opd_label("else", node->label_num));
+			gen_stmt(then, breakLabel);
+			emit1(I_JMP, opd_label("end", node->label_num));
+			emit1(I_LABEL, opd_label("else", node->label_num));
+			gen_stmt(els, breakLabel);
+			emit1(I_LABEL, opd_label("end", node->label_num));
+		} else {
+			gen_cond(cond, false, opd_label("end", node->label_num));
+			gen_stmt(then, breakLabel);
+			emit1(I_LABEL, opd_label("end", node->label_num));
+		}
+		comment("if ends");
+		return;
+	}
+	case ND_WHILE:
+		comment("while starts");
+		// lhs: condition
+		// rhs: statement to execute when condition is true
+		if (loop_rotate) {
+			// The condition is tested once before the loop and then at the bottom, so that each
+			// iteration takes a single branch.
+			gen_cond(nd(node->lhs), false, opd_label("end", node->label_num));
+			emit1(I_LABEL, opd_label("begin", node->label_num));
+			gen_stmt(nd(node->rhs), node->label_num);
+			gen_cond(nd(node->lhs), true, opd_label("begin", node->label_num));
+			emit1(I_LABEL, opd_label("end", node->label_num));
+			comment("while ends");
+			return;
+		}
+		emit1(I_LABEL, opd_label("begin", node->label_num));
+		gen_cond(nd(node->lhs), false, opd_label("end", node->label_num));
+		gen_stmt(nd(node->rhs), node->label_num);
+		emit1(I_JMP, opd_label("begin", node->label_num));
+		emit1(I_LABEL, opd_label("end", node->label_num));
+		comment("while ends");
+		return;
+	case ND_FOR: {
+		comment("for starts");
+		Node *init = nd(child(node, 0));      // optional
+		Node *cond = nd(child(node, 1));      // optional
+		Node *increment = nd(child(node, 2)); // optional
+		Node *body = nd(child(node, 3));
+		gen_stmt(init, breakLabel);
+		if (loop_rotate && cond) {
+			// Like while, test the condition once before the loop and then at the bottom.
+			gen_cond(cond, false, opd_label("end", node->label_num));
+			emit1(I_LABEL, opd_label("begin", node->label_num));
+			gen_stmt(body, node->label_num);
+			gen_stmt(increment, node->label_num);
+			gen_cond(cond, true, opd_label("begin", node->label_num));
+			emit1(I_LABEL, opd_label("end", node->label_num));
+			comment("for ends");
+			return;
+		}
+		emit1(I_LABEL, opd_label("begin", node->label_num));
+		if (cond) {
+			gen_cond(cond, false, opd_label("end", node->label_num));
+		}
+		gen_stmt(body, node->label_num);
+		gen_stmt(increment, node->label_num);
+		emit1(I_JMP, opd_label("begin", node->label_num));
+		// If the condition expression is missing, it seems that this label isn't required.
+		// But when the break statement is used in this for statement, this label is required to break from it.
+		emit1(I_LABEL, opd_label("end", node->label_num));
+		comment("for ends");
+		return;
+	}
+	case ND_BREAK:
+		comment("break starts");
+		
+		if (breakLabel == NO_BREAK_LABEL) {
+			error("`break` can only be used in for or while statement.");
+		}
+		emit1(I_JMP, opd_label("end", breakLabel));
+		comment("break ends");
+		return;
+	case ND_BLOCK:
+		comment("block starts");
+		
+		for (int i = 0; i < node->rhs; i++) {
+			// If the statement is an expression, discards its result.
+			gen_stmt(nd(child(node, i)), breakLabel);
+		}
+		comment("block ends");
+		return;
+	}
+
+	gen(nd(node->lhs), NO_BREAK_LABEL);
+	gen(nd(node->rhs), NO_BREAK_LABEL);
+
+	emit1(I_POP, opd_reg(RDI));
+	emit1(I_POP, opd_reg(RAX));
+
+	switch (node->kind) {
+	case ND_EQ:
+	case ND_NE:
+	case ND_LT:
+	case ND_LE:
+		emit2(I_CMP, opd_reg(RAX), opd_reg(RDI));
+		emit(I_SETCC, cmp_cc(node->kind), opd_reg(RAX), opd_none());
+		emit2(I_MOVZB, opd_reg(RAX), opd_reg(RAX));
+		break;
+	case ND_ADD:
+		emit2(I_ADD, opd_reg(RAX), opd_reg(RDI));
+		break;
+	case ND_SUB:
+		emit2(I_SUB, opd_reg(RAX), opd_reg(RDI));
+		break;
+	case ND_MUL:
+		emit2(I_IMUL, opd_reg(RAX), opd_reg(RDI));
+		break;
+	case ND_DIV:
+		emit0(I_CQO);
+		emit1(I_IDIV, opd_reg(RDI));
+		break;
+	}
+
+	emit1(I_PUSH, opd_reg(RAX));
+}
+
+// gen_func generates a function definition.
+void gen_func(int func_id) {
+	Function *func = &code[func_id];
+	label_func = func_id;
+	emit1(I_GLOBAL, opd_sym(func->name));
+	emit1(I_LABEL, opd_sym(func->name));
+	emit1(I_PUSH, opd_reg(RBP));
+	emit2(I_MOV, opd_reg(RBP), opd_reg(RSP));
+
+	locals_size = func->locals_size;
+	lvar_regs = NULL;
+	num_saved_regs = 0;
+	if (opt_level >= 1) {
+		promote_lvars(func);
+	}
+
+	int frame_size = locals_size + 8 * num_saved_regs;
+	if (frame_size) {
+		emit2(I_SUB, opd_reg(RSP), opd_imm(frame_size));
+	}
+	for (int i = 0; i < num_saved_regs; i++) {
+		emit2(I_MOV, saved_reg_opd(i), opd_reg(promoted_regs[i]));
+	}
+
+	if (func->num_params > NUM_ARG_REGS) {
+		error("too many parameters of %s", func->name);
+	}
+	for (int i = 0; i < func->num_params; i++) {
+		Node *arg = nd(node_lists[func->params + i]);
+		Reg arg_reg = arg_regs[i];
+		if (opt_level >= 1) {
+			emit2(I_MOV, lvar_opd(arg), opd_reg(arg_reg));
+			continue;
+		}
+
+		gen_lval(arg);
+		emit1(I_POP, opd_reg(RAX));
+		emit2(I_MOV, opd_mem(RAX, 0), opd_reg(arg_reg));
+	}
+
+	gen(nd(func->body), NO_BREAK_LABEL);
+
+	gen_epilogue();
+	free(lvar_regs);
+	lvar_regs = NULL;
+}
+
+// num_jobs is the number of threads generating functions, set by -j.
+int num_jobs = 1;
+
+// func_insns is the number of instructions of each function indexed by func_id.
+// It is allocated only for --stats.
+int *func_insns;
+
+// gen_func_insns generates a function and prints its instructions.
+void gen_func_insns(int func_id) {
+	gen_func(func_id);
+	int n = flush_insns();
+	if (func_insns) {
+		func_insns[func_id] = n;
+	}
+}
+
+// Slice is the assembly of a function in the buffer of the worker which generated it.
+typedef struct {
+	int worker;
+	size_t offset;
+	size_t len;
+} Slice;
+
+// Worker is a thread generating functions. It takes the next function from code until none
+// is left, so that the work is balanced even if the sizes of the functions vary.
+// When it finishes, it hands its buffer and counters over to the main thread.
+typedef struct {
+	pthread_t thread;
+	int id;
+	char *buf;
+	SymRef *sym_refs; // -c
+	int num_sym_refs;
+	int peephole_hits[NUM_PEEPHOLE_RULES + 1];
+} Worker;
+
+// next_func is the index in code of the next function for a worker to take.
+atomic_int next_func;
+
+// slices is where the assembly of each function in code is.
+Slice *slices;
+
+void *run_worker(void *arg) {
+	Worker *worker = arg;
+	for (;;) {
+		int i = atomic_fetch_add(&next_func, 1);
+		if (i >= num_code) {
+			break;
+		}
+		size_t start = out_len;
+		gen_func_insns(i);
+		slices[i] = (Slice){worker->id, start, out_len - start};
+	}
+
+	worker->buf = out_buf;
+	worker->sym_refs = sym_refs;
+	worker->num_sym_refs = num_sym_refs;
+	memcpy(worker->peephole_hits, peephole_hits, sizeof(peephole_hits));
+	free(insns);
+	free(label_defs);
+	free(fixups);
+	return NULL;
+}
+
+// gen_code appends the assembly or the machine code of the functions in code to out_buf in the
+// order of the source, and adds up the hits of the peephole rules in hits. With -j, the functions
+// are generated by worker threads and their code is concatenated, which gives the same output.
+void gen_code(int *hits) {
+	// A worker without a function to generate would only cost a thread.
+	int jobs = num_jobs < num_code ? num_jobs : num_code;
+	if (jobs <= 1) {
+		for (int i = 0; i < num_code; i++) {
+			gen_func_insns(i);
+		}
+		memcpy(hits, peephole_hits, sizeof(peephole_hits));
+		return;
+	}
+
+	slices = calloc(num_code, sizeof(Slice));
+	Worker *workers = calloc(jobs, sizeof(Worker));
+	for (int w = 0; w < jobs; w++) {
+		workers[w].id = w;
+		if (pthread_create(&workers[w].thread, NULL, run_worker, &workers[w])) {
+			error("cannot create a thread");
+		}
+	}
+	for (int w = 0; w < jobs; w++) {
+		pthread_join(workers[w].thread, NULL);
+		for (int r = 0; r <= NUM_PEEPHOLE_RULES; r++) {
+			hits[r] += workers[w].peephole_hits[r];
+		}
+	}
+
+	// The slices of a worker and its SymRefs are in the order of their offsets, so the SymRefs
+	// of each slice are found by advancing a cursor per worker.
+	int *cursors = calloc(jobs, sizeof(int));
+	for (int i = 0; i < num_code; i++) {
+		Slice *slice = &slices[i];
+		Worker *worker = &workers[slice->worker];
+		int *cursor = &cursors[slice->worker];
+		for (; *cursor < worker->num_sym_refs; (*cursor)++) {
+			SymRef *ref = &worker->sym_refs[*cursor];
+			if (ref->offset >= slice->offset + slice->len) {
+				break;
+			}
+			size_t offset = out_len + (ref->offset - slice->offset);
+			add_sym_ref(ref->name, ref->is_def);
+			sym_refs[num_sym_refs - 1].offset = offset;
+		}
+		out_mem(worker->buf + slice->offset, slice->len);
+	}
+	for (int w = 0; w < jobs; w++) {
+		free(workers[w].buf);
+		free(workers[w].sym_refs);
+	}
+	free(cursors);
+	free(workers);
+	free(slices);
+}
+
+// ObjSym is a symbol of the object, keyed by its interned name.
+typedef struct {
+	char *name;
+	int index;      // in .symtab
+	int name_off;   // in .strtab
+	bool defined;
+	size_t offset;  // in .text if defined
+} ObjSym;
+
+// obj_syms is an open addressing hash table of the symbols of the object, and
+// obj_sym_order lists them by index. Index 0 is the null symbol.
+ObjSym *obj_syms;
+int obj_syms_cap;
+ObjSym **obj_sym_order;
+int num_obj_syms;
+
+// find_obj_sym returns the entry of the table for a name. If the name isn't in the table,
+// it returns the empty entry to put the name in.
+ObjSym *find_obj_sym(char *name) {
+	for (int i = hash_ptr(name) & (obj_syms_cap - 1);; i = (i + 1) & (obj_syms_cap - 1)) {
+		if (obj_syms[i].name == name || !obj_syms[i].name) {
+			return &obj_syms[i];
+		}
+	}
+}
+
+// collect_obj_syms makes a symbol for each function defined or called, numbered in the order
+// they appear, and returns the size of the string table of their names.
+size_t collect_obj_syms() {
+	obj_syms_cap = 256;
+	while (obj_syms_cap < num_sym_refs * 2) {
+		obj_syms_cap *= 2;
+	}
+	obj_syms = calloc(obj_syms_cap, sizeof(ObjSym));
+	obj_sym_order = calloc(num_sym_refs + 1, sizeof(ObjSym *));
+	num_obj_syms = 1;
+	size_t strtab_size = 1;
+	for (int i = 0; i < num_sym_refs; i++) {
+		SymRef *ref = &sym_refs[i];
+		char *name = ref->name;
+		ObjSym *sym = find_obj_sym(name);
+		if (!sym->name) {
+			*sym = (ObjSym){name, num_obj_syms, strtab_size};
+			obj_sym_order[num_obj_syms++] = sym;
+			strtab_size += strlen(name) + 1;
+		}
+		if (ref->is_def) {
+			sym->defined = true;
+			sym->offset = ref->offset;
+		}
+	}
+	return strtab_size;
+}
+
+// find_ref_sym returns the symbol a SymRef refers to.
+ObjSym *find_ref_sym(SymRef *ref) {
+	return find_obj_sym(ref->name);
+}
+
+// out_align pads out_buf with zeros to a multiple of align.
+void out_align(size_t align) {
+	while (out_len % align) {
+		out_char(0);
+	}
+}
+
+// write_object replaces the machine code in out_buf with an ELF relocatable object holding it
+// in .text. The functions become global symbols, and each call gets a relocation against its
+// callee, which may be defined in another object.
+void write_object() {
+	char *text = out_buf;
+	size_t text_size = out_len;
+	out_buf = NULL;
+	out_len = 0;
+	out_cap = 0;
+
+	// The null symbol is the only local one.
+	size_t strtab_size = collect_obj_syms();
+
+	char shstrtab[] = "\0.text\0.rela.text\0.symtab\0.strtab\0.shstrtab\0.note.GNU-stack";
+	enum { SEC_NULL, SEC_TEXT, SEC_RELA, SEC_SYMTAB, SEC_STRTAB, SEC_SHSTRTAB, SEC_NOTE, NUM_SECS };
+	Elf64_Shdr shdrs[NUM_SECS] = {0};
+
+	Elf64_Ehdr ehdr = {0};
+	memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+	ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+	ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+	ehdr.e_type = ET_REL;
+	ehdr.e_machine = EM_X86_64;
+	ehdr.e_version = EV_CURRENT;
+	ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+	ehdr.e_shentsize = sizeof(Elf64_Shdr);
+	ehdr.e_shnum = NUM_SECS;
+	ehdr.e_shstrndx = SEC_SHSTRTAB;
+	out_mem((char *)&ehdr, sizeof(ehdr));
+
+	Elf64_Shdr *sh = &shdrs[SEC_TEXT];
+	out_align(16);
+	*sh = (Elf64_Shdr){1, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 0, out_len, text_size, 0, 0, 16, 0};
+	out_mem(text, text_size);
+	free(text);
+
+	sh = &shdrs[SEC_RELA];
+	out_align(8);
+	sh->sh_offset = out_len;
+	for (int i = 0; i < num_sym_refs; i++) {
+		if (sym_refs[i].is_def) {
+			continue;
+		}
+		ObjSym *sym = find_ref_sym(&sym_refs[i]);
+		Elf64_Rela rela = {sym_refs[i].offset, ELF64_R_INFO(sym->index, R_X86_64_PLT32), -4};
+		out_mem((char *)&rela, sizeof(rela));
+	}
+	*sh = (Elf64_Shdr){7, SHT_RELA, SHF_INFO_LINK, 0, sh->sh_offset, out_len - sh->sh_offset,
+					   SEC_SYMTAB, SEC_TEXT, 8, sizeof(Elf64_Rela)};
+
+	sh = &shdrs[SEC_SYMTAB];
+	sh->sh_offset = out_len;
+	Elf64_Sym null_sym = {0};
+	out_mem((char *)&null_sym, sizeof(null_sym));
+	for (int i = 1; i < num_obj_syms; i++) {
+		ObjSym *sym = obj_sym_order[i];
+		Elf64_Sym esym = {0};
+		esym.st_name = sym->name_off;
+		if (sym->defined) {
+			esym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+			esym.st_shndx = SEC_TEXT;
+			esym.st_value = sym->offset;
+		} else {
+			esym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+			esym.st_shndx = SHN_UNDEF;
+		}
+		out_mem((char *)&esym, sizeof(esym));
+	}
+	*sh = (Elf64_Shdr){18, SHT_SYMTAB, 0, 0, sh->sh_offset, out_len - sh->sh_offset,
+					   SEC_STRTAB, 1, 8, sizeof(Elf64_Sym)};
+
+	sh = &shdrs[SEC_STRTAB];
+	sh->sh_offset = out_len;
+	out_char(0);
+	for (int i = 1; i < num_obj_syms; i++) {
+		out_mem(obj_sym_order[i]->name, strlen(obj_sym_order[i]->name) + 1);
+	}
+	*sh = (Elf64_Shdr){26, SHT_STRTAB, 0, 0, sh->sh_offset, strtab_size, 0, 0, 1, 0};
+
+	shdrs[SEC_SHSTRTAB] = (Elf64_Shdr){34, SHT_STRTAB, 0, 0, out_len, sizeof(shstrtab), 0, 0, 1, 0};
+	out_mem(shstrtab, sizeof(shstrtab));
+
+	// An empty .note.GNU-stack tells the linker that the stack needn't be executable.
+	shdrs[SEC_NOTE] = (Elf64_Shdr){44, SHT_PROGBITS, 0, 0, out_len, 0, 0, 0, 1, 0};
+
+	out_align(8);
+	size_t shoff = out_len;
+	out_mem((char *)shdrs, sizeof(shdrs));
+	((Elf64_Ehdr *)out_buf)->e_shoff = shoff;
+
+	free(obj_sym_order);
+	free(obj_syms);
+}
+
+// run_jit is set by --run to execute the program in n9cc instead of writing it out.
+// The instructions are encoded as with -c.
+bool run_jit;
+
+// The functions of helper.c, which is linked into n9cc.
+int ret42();
+int id(int v);
+int add2(int a, int b);
+int add3(int a, int b, int c);
+int add4(int a, int b, int c, int d);
+int add5(int a, int b, int c, int d, int e);
+int add6(int a, int b, int c, int d, int e, int f);
+
+// HostFunc is a function of n9cc which programs run by --run can call.
+typedef struct {
+	char *name;
+	void *addr;
+} HostFunc;
+
+// host_funcs are the functions --run links programs with, which are the ones the tests link
+// native programs with.
+HostFunc host_funcs[] = {
+	{"ret42", (void *)ret42},
+	{"id", (void *)id},
+	{"add2", (void *)add2},
+	{"add3", (void *)add3},
+	{"add4", (void *)add4},
+	{"add5", (void *)add5},
+	{"add6", (void *)add6},
+};
+
+// STUB_SIZE is the size of a stub jumping to a host function: jmp [rip+0] followed by the
+// address, padded. Calls can't reach host functions with rel32, but they can reach the stubs.
+#define STUB_SIZE 16
+
+// run_program loads the machine code in out_buf into executable memory, links the calls, and
+// calls main. It returns what main returns.
+int run_program() {
+	collect_obj_syms();
+	int num_stubs = 0;
+	for (int i = 1; i < num_obj_syms; i++) {
+		if (!obj_sym_order[i]->defined) {
+			num_stubs++;
+		}
+	}
+
+	size_t code_size = (out_len + 15) & ~(size_t)15;
+	size_t size = code_size + num_stubs * STUB_SIZE;
+	char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		error("cannot map memory for the program: %s", strerror(errno));
+	}
+	memcpy(mem, out_buf, out_len);
+
+	// Undefined symbols are resolved to stubs of host functions, which take the place of the
+	// symbols' offsets.
+	char *stub = mem + code_size;
+	for (int i = 1; i < num_obj_syms; i++) {
+		ObjSym *sym = obj_sym_order[i];
+		if (sym->defined) {
+			continue;
+		}
+		void *addr = NULL;
+		for (size_t j = 0; j < sizeof(host_funcs) / sizeof(HostFunc); j++) {
+			if (!strcmp(host_funcs[j].name, sym->name)) {
+				addr = host_funcs[j].addr;
+				break;
+			}
+		}
+		if (!addr) {
+			error("undefined function: %s", sym->name);
+		}
+		memcpy(stub, "\xff\x25\0\0\0\0", 6);
+		memcpy(stub + 6, &addr, 8);
+		sym->offset = stub - mem;
+		stub += STUB_SIZE;
+	}
+
+	for (int i = 0; i < num_sym_refs; i++) {
+		SymRef *ref = &sym_refs[i];
+		if (!ref->is_def) {
+			int rel = find_ref_sym(ref)->offset - (ref->offset + 4);
+			memcpy(mem + ref->offset, &rel, 4);
+		}
+	}
+
+	if (mprotect(mem, size, PROT_READ | PROT_EXEC)) {
+		error("cannot make the program executable: %s", strerror(errno));
+	}
+	ObjSym *main_sym = find_obj_sym(intern("main", 4));
+	int (*main_func)() = (int (*)())(mem + main_sym->offset);
+	int status = main_func();
+
+	munmap(mem, size);
+	free(obj_sym_order);
+	free(obj_syms);
+	return status;
+}
+
+// interp is set by --interp to run the program on the bytecode interpreter instead of
+// generating code.
+bool interp;
+
+// BcOp is an operation of the bytecode. The bytecode runs on a stack machine whose frames
+// hold the local variables followed by the operand stack.
+typedef enum {
+	BC_PUSH_IMM,   // push b
+	BC_LOAD_LOCAL, // push local a
+	BC_ADDR_LOCAL, // push the address of local a
+	BC_STORE_LOCAL,// local a = top
+	BC_LOAD,       // replace the address on the top with the value at it
+	BC_STORE,      // pop the value and the address, store the value, push the value
+	BC_POP,
+	BC_ADD,
+	BC_SUB,
+	BC_MUL,
+	BC_DIV,
+	BC_EQ,
+	BC_NE,
+	BC_LT,
+	BC_LE,
+	BC_JMP,        // jump to b
+	BC_JZ,         // pop, and jump to b if it's 0
+	BC_CALL,       // call function b with a arguments
+	BC_CALL_HOST,  // call host function b with a arguments
+	BC_RET,        // return the top
+	BC_RET_LAST,   // return the last value discarded, like native code falling off a function
+	// Superinstructions, which fuse common pairs of operations.
+	BC_ADD_LOCAL,  // LOAD_LOCAL a; ADD
+	BC_ADD_IMM,    // PUSH_IMM b; ADD
+	BC_SET_LOCAL,  // STORE_LOCAL a; POP
+	BC_EQ_JZ,      // EQ; JZ b
+	BC_NE_JZ,      // NE; JZ b
+	BC_LT_JZ,      // LT; JZ b
+	BC_LE_JZ,      // LE; JZ b
+	NUM_BC_OPS,
+} BcOp;
+
+// BcIns is an instruction of the bytecode. handler is the address of the code of op in the
+// interpreter, which is filled in when it starts, so that the dispatch is a single jump.
+typedef struct {
+	void *handler;
+	BcOp op;
+	int a;
+	long b;
+} BcIns;
+
+// BcFunc is a function lowered to the bytecode.
+typedef struct {
+	char *name;
+	int entry;
+	int num_params;
+	int num_locals; // including the parameters
+	int frame_size; // the local variables and the deepest operand stack
+} BcFunc;
+
+// bc is the bytecode of all functions.
+BcIns *bc;
+int num_bc;
+int cap_bc;
+
+BcFunc *bc_funcs;
+BcFunc *bc_main;
+
+// bc_barrier is the first instruction which may be fused with the next one. Jump targets
+// raise it, so that a superinstruction never swallows one.
+int bc_barrier;
+
+// bc_depth is the depth of the operand stack after the last instruction, and bc_max_depth
+// is its maximum in the function being lowered.
+int bc_depth;
+int bc_max_depth;
+
+// BcCall is a call to be resolved when all functions are lowered.
+typedef struct {
+	int at;
+	char *name;
+} BcCall;
+
+BcCall *bc_calls;
+int num_bc_calls;
+int cap_bc_calls;
+
+// bc_breaks are the jumps of `break` waiting for the end of their loops, and bc_loop_depth
+// is the number of loops around the statement being lowered.
+int *bc_breaks;
+int num_bc_breaks;
+int cap_bc_breaks;
+int bc_loop_depth;
+
+// bc_effect is how each operation changes the depth of the operand stack. Calls are
+// adjusted by their number of arguments.
+int bc_effect[NUM_BC_OPS] = {
+	[BC_PUSH_IMM] = 1, [BC_LOAD_LOCAL] = 1, [BC_ADDR_LOCAL] = 1, [BC_STORE] = -1, [BC_POP] = -1,
+	[BC_ADD] = -1, [BC_SUB] = -1, [BC_MUL] = -1, [BC_DIV] = -1,
+	[BC_EQ] = -1, [BC_NE] = -1, [BC_LT] = -1, [BC_LE] = -1, [BC_JZ] = -1,
+	[BC_CALL] = 1, [BC_CALL_HOST] = 1, [BC_RET] = -1,
+};
+
+// fuse returns the superinstruction doing prev followed by op, or NUM_BC_OPS if there isn't one.
+BcOp fuse(BcOp prev, BcOp op) {
+	switch (op) {
+	case BC_ADD:
+		return prev == BC_LOAD_LOCAL ? BC_ADD_LOCAL : prev == BC_PUSH_IMM ? BC_ADD_IMM : NUM_BC_OPS;
+	case BC_SUB:
+		return prev == BC_PUSH_IMM ? BC_ADD_IMM : NUM_BC_OPS;
+	case BC_POP:
+		return prev == BC_STORE_LOCAL ? BC_SET_LOCAL : NUM_BC_OPS;
+	case BC_JZ:
+		switch (prev) {
+		case BC_EQ: return BC_EQ_JZ;
+		case BC_NE: return BC_NE_JZ;
+		case BC_LT: return BC_LT_JZ;
+		case BC_LE: return BC_LE_JZ;
+		default: return NUM_BC_OPS;
+		}
+	default:
+		return NUM_BC_OPS;
+	}
+}
+
+// bc_emit appends an instruction, fusing it with the previous one if possible, and returns
+// its index.
+int bc_emit(BcOp op, int a, long b) {
+	bc_depth += bc_effect[op];
+	if (op == BC_CALL || op == BC_CALL_HOST) {
+		bc_depth -= a;
+	}
+	if (bc_depth > bc_max_depth) {
+		bc_max_depth = bc_depth;
+	}
+
+	if (num_bc > bc_barrier) {
+		BcIns *prev = &bc[num_bc - 1];
+		BcOp fused = fuse(prev->op, op);
+		if (fused != NUM_BC_OPS) {
+			prev->op = fused;
+			if (op == BC_SUB) {
+				prev->b = -prev->b;
+			} else if (op == BC_JZ) {
+				prev->b = b;
+			}
+			return num_bc - 1;
+		}
+	}
+
+	if (num_bc == cap_bc) {
+		cap_bc = cap_bc ? cap_bc * 2 : 1024;
+		bc = realloc(bc, cap_bc * sizeof(BcIns));
+	}
+	bc[num_bc] = (BcIns){NULL, op, a, b};
+	return num_bc++;
+}
+
+// bc_label returns the index of the next instruction as a jump target.
+int bc_label() {
+	bc_barrier = num_bc;
+	return num_bc;
+}
+
+void bc_patch(int at, int target) {
+	bc[at].b = target;
+}
+
+int lvar_slot(Node *node) {
+	return node->offset / 8 - 1;
+}
+
+void lower_expr(Node *node);
+void lower_stmt(Node *node);
+
+// lower_addr lowers an expression to its address.
+void lower_addr(Node *node) {
+	switch (node->kind) {
+	case ND_LVAR:
+		bc_emit(BC_ADDR_LOCAL, lvar_slot(node), 0);
+		return;
+	case ND_DEREF:
+		lower_expr(nd(node->lhs));
+		return;
+	default:
+		error("left value must be a variable or a dereference");
+	}
+}
+
+// lower_expr lowers an expression, which leaves its value on the operand stack.
+void lower_expr(Node *node) {
+	switch (node->kind) {
+	case ND_NUM:
+		bc_emit(BC_PUSH_IMM, 0, node->val);
+		return;
+	case ND_LVAR:
+		bc_emit(BC_LOAD_LOCAL, lvar_slot(node), 0);
+		return;
+	case ND_ADDR:
+		lower_addr(nd(node->lhs));
+		return;
+	case ND_DEREF:
+		lower_expr(nd(node->lhs));
+		bc_emit(BC_LOAD, 0, 0);
+		return;
+	case ND_ASSIGN:
+		if (nd(node->lhs)->kind == ND_LVAR) {
+			lower_expr(nd(node->rhs));
+			bc_emit(BC_STORE_LOCAL, lvar_slot(nd(node->lhs)), 0);
+			return;
+		}
+		lower_addr(nd(node->lhs));
+		lower_expr(nd(node->rhs));
+		bc_emit(BC_STORE, 0, 0);
+		return;
+	case ND_FUNCCALL: {
+		int nargs = node->rhs;
+		if (nargs > NUM_ARG_REGS) {
+			error("too many arguments to %s", idents[node->name]);
+		}
+		for (int i = 0; i < nargs; i++) {
+			lower_expr(nd(child(node, i)));
+		}
+		if (num_bc_calls == cap_bc_calls) {
+			cap_bc_calls = cap_bc_calls ? cap_bc_calls * 2 : 256;
+			bc_calls = realloc(bc_calls, cap_bc_calls * sizeof(BcCall));
+		}
+		bc_calls[num_bc_calls++] = (BcCall){bc_emit(BC_CALL, nargs, 0), idents[node->name]};
+		return;
+	}
+	}
+
+	lower_expr(nd(node->lhs));
+	lower_expr(nd(node->rhs));
+	switch (node->kind) {
+	case ND_EQ: bc_emit(BC_EQ, 0, 0); return;
+	case ND_NE: bc_emit(BC_NE, 0, 0); return;
+	case ND_LT: bc_emit(BC_LT, 0, 0); return;
+	case ND_LE: bc_emit(BC_LE, 0, 0); return;
+	case ND_ADD: bc_emit(BC_ADD, 0, 0); return;
+	case ND_SUB: bc_emit(BC_SUB, 0, 0); return;
+	case ND_MUL: bc_emit(BC_MUL, 0, 0); return;
+	case ND_DIV: bc_emit(BC_DIV, 0, 0); return;
+	default: error("cannot lower a node of kind %d", node->kind);
+	}
+}
+
+// lower_loop_body lowers the body of a loop followed by a jump back to begin. The breaks in
+// the body are patched to jump past it.
+void lower_loop_body(Node *body, Node *increment, int begin) {
+	int breaks = num_bc_breaks;
+	bc_loop_depth++;
+	lower_stmt(body);
+	lower_stmt(increment);
+	bc_loop_depth--;
+	bc_emit(BC_JMP, 0, begin);
+	int end = bc_label();
+	for (int i = breaks; i < num_bc_breaks; i++) {
+		bc_patch(bc_breaks[i], end);
+	}
+	num_bc_breaks = breaks;
+}
+
+// lower_stmt lowers a statement. If the statement is an expression, its result is discarded.
+void lower_stmt(Node *node) {
+	if (!node) {
+		return;
+	}
+	if (is_expr_node(node->kind)) {
+		lower_expr(node);
+		bc_emit(BC_POP, 0, 0);
+		return;
+	}
+
+	switch (node->kind) {
+	case ND_RETURN:
+		lower_expr(nd(node->lhs));
+		bc_emit(BC_RET, 0, 0);
+		return;
+	case ND_IF: {
+		lower_expr(nd(child(node, 0)));
+		int jz = bc_emit(BC_JZ, 0, 0);
+		lower_stmt(nd(child(node, 1)));
+		if (child(node, 2)) {
+			int jmp = bc_emit(BC_JMP, 0, 0);
+			bc_patch(jz, bc_label());
+			lower_stmt(nd(child(node, 2)));
+			jz = jmp;
+		}
+		bc_patch(jz, bc_label());
+		return;
+	}
+	case ND_WHILE: {
+		int begin = bc_label();
+		lower_expr(nd(node->lhs));
+		int jz = bc_emit(BC_JZ, 0, 0);
+		lower_loop_body(nd(node->rhs), NULL, begin);
+		bc_patch(jz, num_bc);
+		return;
+	}
+	case ND_FOR: {
+		lower_stmt(nd(child(node, 0)));
+		int begin = bc_label();
+		int jz = -1;
+		if (child(node, 1)) {
+			lower_expr(nd(child(node, 1)));
+			jz = bc_emit(BC_JZ, 0, 0);
+		}
+		lower_loop_body(nd(child(node, 3)), nd(child(node, 2)), begin);
+		if (jz >= 0) {
+			bc_patch(jz, num_bc);
+		}
+		return;
+	}
+	case ND_BREAK: {
+		if (bc_loop_depth == 0) {
+			error("`break` can only be used in for or while statement.");
+		}
+		if (num_bc_breaks == cap_bc_breaks) {
+			cap_bc_breaks = cap_bc_breaks ? cap_bc_breaks * 2 : 64;
+			bc_breaks = realloc(bc_breaks, cap_bc_breaks * sizeof(int));
+		}
+		bc_breaks[num_bc_breaks++] = bc_emit(BC_JMP, 0, 0);
+		return;
+	}
+	case ND_BLOCK:
+		for (int i = 0; i < node->rhs; i++) {
+			lower_stmt(nd(child(node, i)));
+		}
+		return;
+	default:
+		error("cannot lower a node of kind %d", node->kind);
+	}
+}
+
+// lower_program lowers the functions in code to the bytecode, and links the calls with the
+// functions or the host functions.
+void lower_program() {
+	bc_funcs = calloc(num_code, sizeof(BcFunc));
+	obj_syms_cap = 256;
+	while (obj_syms_cap < num_code * 2) {
+		obj_syms_cap *= 2;
+	}
+	obj_syms = calloc(obj_syms_cap, sizeof(ObjSym));
+
+	char *main_name = intern("main", 4);
+	for (int i = 0; i < num_code; i++) {
+		BcFunc *func = &bc_funcs[i];
+		func->name = code[i].name;
+		func->entry = bc_label();
+		func->num_params = code[i].num_params;
+		func->num_locals = code[i].locals_size / 8;
+		*find_obj_sym(func->name) = (ObjSym){.name = func->name, .index = i, .defined = true};
+		if (func->name == main_name) {
+			bc_main = func;
+		}
+
+		bc_depth = 0;
+		bc_max_depth = 0;
+		lower_stmt(nd(code[i].body));
+		bc_emit(BC_RET_LAST, 0, 0);
+		func->frame_size = func->num_locals + bc_max_depth;
+	}
+
+	for (int i = 0; i < num_bc_calls; i++) {
+		BcIns *ins = &bc[bc_calls[i].at];
+		ObjSym *sym = find_obj_sym(bc_calls[i].name);
+		if (sym->name) {
+			ins->b = sym->index;
+			continue;
+		}
+		ins->op = BC_CALL_HOST;
+		ins->b = -1;
+		for (size_t j = 0; j < sizeof(host_funcs) / sizeof(HostFunc); j++) {
+			if (!strcmp(host_funcs[j].name, bc_calls[i].name)) {
+				ins->b = j;
+				break;
+			}
+		}
+		if (ins->b < 0) {
+			error("undefined function: %s", bc_calls[i].name);
+		}
+	}
+	free(obj_syms);
+	obj_syms = NULL;
+}
+
+// call_host calls a host function with the arguments. Like native code, it passes the
+// arguments to the functions of helper.c as int, and takes the 32-bit result zero-extended.
+long call_host(void *func, int nargs, long *args) {
+	typedef int (*F0)();
+	typedef int (*F1)(int);
+	typedef int (*F2)(int, int);
+	typedef int (*F3)(int, int, int);
+	typedef int (*F4)(int, int, int, int);
+	typedef int (*F5)(int, int, int, int, int);
+	typedef int (*F6)(int, int, int, int, int, int);
+	long *a = args;
+	switch (nargs) {
+	case 0: return (unsigned)((F0)func)();
+	case 1: return (unsigned)((F1)func)(a[0]);
+	case 2: return (unsigned)((F2)func)(a[0], a[1]);
+	case 3: return (unsigned)((F3)func)(a[0], a[1], a[2]);
+	case 4: return (unsigned)((F4)func)(a[0], a[1], a[2], a[3]);
+	case 5: return (unsigned)((F5)func)(a[0], a[1], a[2], a[3], a[4]);
+	default: return (unsigned)((F6)func)(a[0], a[1], a[2], a[3], a[4], a[5]);
+	}
+}
+
+// BcFrame is the state of a caller saved by a call.
+typedef struct {
+	BcIns *ret;
+	long *fp;
+} BcFrame;
+
+// INTERP_STACK_SIZE is the size of the stack of the interpreter. It's reserved up front,
+// because the addresses of local variables must not change.
+#define INTERP_STACK_SIZE ((size_t)1 << 30)
+
+// interpret runs the bytecode from main and returns what main returns. It uses direct
+// threading: each instruction holds the address of its handler, and each handler jumps to the
+// handler of the next instruction, so that every handler has its own indirect branch.
+long interpret() {
+	static void *handlers[NUM_BC_OPS] = {
+		[BC_PUSH_IMM] = &&push_imm, [BC_LOAD_LOCAL] = &&load_local, [BC_ADDR_LOCAL] = &&addr_local,
+		[BC_STORE_LOCAL] = &&store_local, [BC_LOAD] = &&load, [BC_STORE] = &&store, [BC_POP] = &&pop,
+		[BC_ADD] = &&add, [BC_SUB] = &&sub, [BC_MUL] = &&mul, [BC_DIV] = &&div,
+		[BC_EQ] = &&eq, [BC_NE] = &&ne, [BC_LT] = &&lt, [BC_LE] = &&le,
+		[BC_JMP] = &&jmp, [BC_JZ] = &&jz, [BC_CALL] = &&call, [BC_CALL_HOST] = &&call_host,
+		[BC_RET] = &&ret, [BC_RET_LAST] = &&ret_last, [BC_ADD_LOCAL] = &&add_local,
+		[BC_ADD_IMM] = &&add_imm, [BC_SET_LOCAL] = &&set_local, [BC_EQ_JZ] = &&eq_jz,
+		[BC_NE_JZ] = &&ne_jz, [BC_LT_JZ] = &&lt_jz, [BC_LE_JZ] = &&le_jz,
+	};
+	for (int i = 0; i < num_bc; i++) {
+		bc[i].handler = handlers[bc[i].op];
+	}
+
+	long *stack = mmap(NULL, INTERP_STACK_SIZE, PROT_READ | PROT_WRITE,
+					   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (stack == MAP_FAILED) {
+		error("cannot map the stack of the interpreter: %s", strerror(errno));
+	}
+	long *stack_end = stack + INTERP_STACK_SIZE / sizeof(long);
+	int cap_frames = 1024;
+	BcFrame *frames = malloc(cap_frames * sizeof(BcFrame));
+	int num_frames = 0;
+
+	BcIns *base = bc;
+	BcIns *pc = &base[bc_main->entry];
+	long *fp = stack;
+	long *sp = fp + bc_main->num_locals;
+	// last is the last value discarded or tested, which is in rax when native code falls
+	// off the end of a function.
+	long last = 0;
+	long val;
+
+#define NEXT() goto *(++pc)->handler
+#define JUMP(target) do { pc = &base[target]; goto *pc->handler; } while (0)
+#define COMPARE_JZ(cond) do { sp -= 2; last = (cond); if (!last) JUMP(pc->b); NEXT(); } while (0)
+
+	goto *pc->handler;
+
+push_imm:
+	*sp++ = pc->b;
+	NEXT();
+load_local:
+	*sp++ = fp[pc->a];
+	NEXT();
+addr_local:
+	*sp++ = (long)&fp[pc->a];
+	NEXT();
+store_local:
+	fp[pc->a] = sp[-1];
+	NEXT();
+set_local:
+	last = fp[pc->a] = *--sp;
+	NEXT();
+load:
+	sp[-1] = *(long *)sp[-1];
+	NEXT();
+store:
+	sp--;
+	*(long *)sp[-1] = sp[0];
+	sp[-1] = sp[0];
+	NEXT();
+pop:
+	last = *--sp;
+	NEXT();
+add:
+	sp--;
+	sp[-1] = (unsigned long)sp[-1] + sp[0];
+	NEXT();
+add_local:
+	sp[-1] = (unsigned long)sp[-1] + fp[pc->a];
+	NEXT();
+add_imm:
+	sp[-1] = (unsigned long)sp[-1] + pc->b;
+	NEXT();
+sub:
+	sp--;
+	sp[-1] = (unsigned long)sp[-1] - sp[0];
+	NEXT();
+mul:
+	sp--;
+	sp[-1] = (unsigned long)sp[-1] * sp[0];
+	NEXT();
+div:
+	sp--;
+	sp[-1] = sp[-1] / sp[0];
+	NEXT();
+eq:
+	sp--;
+	sp[-1] = sp[-1] == sp[0];
+	NEXT();
+ne:
+	sp--;
+	sp[-1] = sp[-1] != sp[0];
+	NEXT();
+lt:
+	sp--;
+	sp[-1] = sp[-1] < sp[0];
+	NEXT();
+le:
+	sp--;
+	sp[-1] = sp[-1] <= sp[0];
+	NEXT();
+eq_jz:
+	COMPARE_JZ(sp[0] == sp[1]);
+ne_jz:
+	COMPARE_JZ(sp[0] != sp[1]);
+lt_jz:
+	COMPARE_JZ(sp[0] < sp[1]);
+le_jz:
+	COMPARE_JZ(sp[0] <= sp[1]);
+jmp:
+	JUMP(pc->b);
+jz:
+	last = *--sp;
+	if (!last) JUMP(pc->b);
+	NEXT();
+call: {
+	// The arguments on the operand stack become the first local variables of the callee.
+	BcFunc *func = &bc_funcs[pc->b];
+	long *callee_fp = sp - pc->a;
+	if (callee_fp + func->frame_size > stack_end) {
+		error("stack overflow in %s", func->name);
+	}
+	if (num_frames == cap_frames) {
+		cap_frames *= 2;
+		frames = realloc(frames, cap_frames * sizeof(BcFrame));
+	}
+	frames[num_frames++] = (BcFrame){pc, fp};
+	fp = callee_fp;
+	sp = fp + func->num_locals;
+	for (long *p = fp + pc->a; p < sp; p++) {
+		*p = 0;
+	}
+	JUMP(func->entry);
+}
+call_host:
+	sp -= pc->a;
+	sp[0] = call_host(host_funcs[pc->b].addr, pc->a, sp);
+	sp++;
+	NEXT();
+ret_last:
+	val = last;
+	goto leave;
+ret:
+	val = sp[-1];
+leave:
+	if (num_frames == 0) {
+		goto done;
+	}
+	sp = fp;
+	*sp++ = val;
+	num_frames--;
+	fp = frames[num_frames].fp;
+	pc = frames[num_frames].ret;
+	NEXT();
+
+#undef NEXT
+#undef JUMP
+#undef COMPARE_JZ
+
+done:
+	munmap(stack, INTERP_STACK_SIZE);
+	free(frames);
+	return val;
+}
+
+// Phase is a phase of the compilation measured by --stats.
+typedef struct {
+	char *name;
+	double wall;      // seconds
+	double cpu;       // seconds of all threads
+	size_t bytes;     // allocated for the tokens, the nodes and the symbols, or of the assembly for gen and emit
+	double start_wall;
+	double start_cpu;
+	size_t start_bytes;
+} Phase;
+
+typedef enum {
+	PH_TOKENIZE,
+	PH_PROGRAM,
+	PH_FOLD,
+	PH_GEN,
+	PH_EMIT,
+	NUM_PHASES,
+} PhaseKind;
+
+Phase phases[NUM_PHASES] = {
+	[PH_TOKENIZE] = {.name = "tokenize"},
+	[PH_PROGRAM] = {.name = "program"},
+	[PH_FOLD] = {.name = "fold"},
+	[PH_GEN] = {.name = "gen"},
+	[PH_EMIT] = {.name = "emit"},
+};
+
+// StatsFormat is the format of the report of --stats.
+typedef enum {
+	STATS_NONE,
+	STATS_TEXT,
+	STATS_JSON,
+} StatsFormat;
+
+StatsFormat stats_format;
+
+double clock_seconds(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// phase_bytes returns the bytes a phase has allocated so far.
+size_t phase_bytes(PhaseKind kind) {
+	if (kind == PH_GEN || kind == PH_EMIT) {
+		return out_len;
+	}
+	return tokens.cap * TOKEN_BYTES + cap_nodes * sizeof(Node) + cap_node_lists * sizeof(NodeId)
+		+ symbol_arena.used;
+}
+
+void phase_start(PhaseKind kind) {
+	Phase *phase = &phases[kind];
+	phase->start_wall = clock_seconds(CLOCK_MONOTONIC);
+	phase->start_cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+	phase->start_bytes = phase_bytes(kind);
+}
+
+void phase_end(PhaseKind kind) {
+	Phase *phase = &phases[kind];
+	phase->wall += clock_seconds(CLOCK_MONOTONIC) - phase->start_wall;
+	phase->cpu += clock_seconds(CLOCK_PROCESS_CPUTIME_ID) - phase->start_cpu;
+	size_t bytes = phase_bytes(kind);
+	// emit drains the output buffer.
+	phase->bytes += bytes > phase->start_bytes ? bytes - phase->start_bytes : phase->start_bytes - bytes;
+}
+
+// print_stats prints the report of --stats to stderr.
+void print_stats(long num_tokens, long num_nodes, size_t output_bytes) {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	long total_insns = 0;
+	int max_func = -1;
+	for (int i = 0; i < num_code; i++) {
+		total_insns += func_insns[i];
+		if (max_func < 0 || func_insns[i] > func_insns[max_func]) {
+			max_func = i;
+		}
+	}
+
+	if (stats_format == STATS_JSON) {
+		fprintf(stderr, "{\"phases\": [");
+		for (int i = 0; i < NUM_PHASES; i++) {
+			fprintf(stderr, "%s{\"name\": \"%s\", \"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"bytes\": %zu}",
+					i ? ", " : "", phases[i].name, phases[i].wall * 1e3, phases[i].cpu * 1e3, phases[i].bytes);
+		}
+		fprintf(stderr, "], \"tokens\": %ld, \"nodes\": %ld, \"instructions\": %ld, \"output_bytes\": %zu, \"peak_rss_kib\": %ld, \"functions\": [",
+				num_tokens, num_nodes, total_insns, output_bytes, usage.ru_maxrss);
+		for (int i = 0; i < num_code; i++) {
+			fprintf(stderr, "%s{\"name\": \"%s\", \"instructions\": %d}", i ? ", " : "", code[i].name, func_insns[i]);
+		}
+		fprintf(stderr, "]}\n");
+		return;
+	}
+
+	fprintf(stderr, "stats: %-10s %10s %10s %12s\n", "phase", "wall ms", "cpu ms", "bytes");
+	for (int i = 0; i < NUM_PHASES; i++) {
+		fprintf(stderr, "stats: %-10s %10.3f %10.3f %12zu\n", phases[i].name, phases[i].wall * 1e3, phases[i].cpu * 1e3, phases[i].bytes);
+	}
+	fprintf(stderr, "stats: tokens: %ld\n", num_tokens);
+	fprintf(stderr, "stats: nodes: %ld\n", num_nodes);
+	fprintf(stderr, "stats: functions: %d\n", num_code);
+	fprintf(stderr, "stats: instructions: %ld, %.1f per function, at most %d in %s\n", total_insns,
+			(double)total_insns / num_code, func_insns[max_func], code[max_func].name);
+	for (int i = 0; i < num_code; i++) {
+		fprintf(stderr, "stats: function %s: %d instructions\n", code[i].name, func_insns[i]);
+	}
+	fprintf(stderr, "stats: output bytes: %zu\n", output_bytes);
+	fprintf(stderr, "stats: peak rss: %ld KiB\n", usage.ru_maxrss);
+}
+
+// mem_report is set by -fmem-report to print the memory usage of the tokens, the nodes and the symbols to stderr.
+bool mem_report;
+
+// read_input reads the source code from a file, or from stdin if the path is "-".
+// A regular file is mapped into memory instead of being copied.
+// Either way, the source code is followed by INPUT_PADDING zero bytes.
+void read_input(char *path) {
+	int fd = STDIN_FILENO;
+	input_path = "<stdin>";
+	if (strcmp(path, "-")) {
+		input_path = path;
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			error("cannot open %s: %s", path, strerror(errno));
+		}
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		size_t size = st.st_size;
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t map_size = (size + INPUT_PADDING + page - 1) / page * page;
+		// Reserve zero pages for the file and the padding, and map the file over them.
+		char *base = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base != MAP_FAILED) {
+			if (mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+				user_input = base;
+				user_input_end = base + size;
+				close(fd);
+				return;
+			}
+			munmap(base, map_size);
+		}
+	}
+
+	// Fall back to reading, e.g. from a pipe.
+	size_t cap = 1 << 16;
+	size_t len = 0;
+	char *buf = malloc(cap + INPUT_PADDING);
+	for (;;) {
+		if (len == cap) {
+			cap *= 2;
+			buf = realloc(buf, cap + INPUT_PADDING);
+		}
+		if (!buf) {
+			error("out of memory");
+		}
+		ssize_t n = read(fd, buf + len, cap - len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			error("cannot read %s: %s", input_path, strerror(errno));
+		}
+		if (n == 0) {
+			break;
+		}
+		len += n;
+	}
+	memset(buf + len, 0, INPUT_PADDING);
+	if (fd != STDIN_FILENO) {
+		close(fd);
+	}
+	user_input = buf;
+	user_input_end = buf + len;
+}
+
+// usage prints how to use n9cc and exits with exit code 1.
+void usage() {
+	error("usage: n9cc [-O0|-O1] [--no-annotate] [-fopt-info] [-fmem-report] [-fpeephole-window=N] [-flexer=scalar|sse2|avx2] [-f[no-]loop-rotate] [-j N] [--stats[=json]] [-c] [-o <output>] [--run] [--interp] [<file>|-]");
+}
+
+int main(int argc, char **argv) {
+	char *path = NULL;
+	char *out_path = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-O0")) {
+			opt_level = 0;
+		} else if (!strcmp(argv[i], "-O1") || !strcmp(argv[i], "-O")) {
+			opt_level = 1;
+		} else if (!strcmp(argv[i], "--no-annotate")) {
+			annotate = false;
+		} else if (!strcmp(argv[i], "-fmem-report")) {
+			mem_report = true;
+		} else if (!strcmp(argv[i], "-fopt-info")) {
+			opt_info = true;
+		} else if (!strncmp(argv[i], "-fpeephole-window=", 18)) {
+			peephole_window = atoi(argv[i] + 18);
+		} else if (!strncmp(argv[i], "-flexer=", 8)) {
+			int n = sizeof(lexer_names) / sizeof(char *);
+			while (--n >= 0 && strcmp(argv[i] + 8, lexer_names[n]));
+			if (n < 0) {
+				usage();
+			}
+			lexer_kind = n;
+		} else if (!strcmp(argv[i], "-floop-rotate")) {
+			loop_rotate = 1;
+		} else if (!strcmp(argv[i], "-fno-loop-rotate")) {
+			loop_rotate = 0;
+		} else if (!strncmp(argv[i], "-j", 2)) {
+			char *n = argv[i][2] ? argv[i] + 2 : argv[++i];
+			if (!n || (num_jobs = atoi(n)) < 1) {
+				usage();
+			}
+		} else if (!strcmp(argv[i], "--run")) {
+			run_jit = true;
+			emit_object = true;
+		} else if (!strcmp(argv[i], "--interp")) {
+			interp = true;
+		} else if (!strcmp(argv[i], "-c")) {
+			emit_object = true;
+		} else if (!strcmp(argv[i], "-o")) {
+			if (!(out_path = argv[++i])) {
+				usage();
+			}
+		} else if (!strcmp(argv[i], "--stats")) {
+			stats_format = STATS_TEXT;
+		} else if (!strcmp(argv[i], "--stats=json")) {
+			stats_format = STATS_JSON;
+		} else if (!path && (argv[i][0] != '-' || !strcmp(argv[i], "-"))) {
+			path = argv[i];
+		} else {
+			usage();
+		}
+	}
+	read_input(path ? path : "-");
+	if (peephole_window < 0) {
+		peephole_window = opt_level >= 1 ? MAX_PEEPHOLE_WINDOW : 0;
+	}
+	if (loop_rotate < 0) {
+		loop_rotate = opt_level >= 1;
+	}
+	
+	phase_start(PH_TOKENIZE);
+	tokenize();
+	phase_end(PH_TOKENIZE);
+	long num_tokens = tokens.len;
+	//	print_tokens();
+
+	phase_start(PH_PROGRAM);
+	program();
+	phase_end(PH_PROGRAM);
+	long parsed_nodes = num_nodes - 1;
+	//	print_code();
+
+	// The AST refers to the source, not to the tokens.
+	free_tokens();
+
+	if (opt_level >= 1) {
+		phase_start(PH_FOLD);
+		int eliminated = fold_program();
+		phase_end(PH_FOLD);
+		if (opt_info) {
+			fprintf(stderr, "fold: eliminated %d nodes\n", eliminated);
+		}
+	}
+
+	char *main_name = intern("main", 4);
+	bool main_found = false;
+	for (int i = 0; i < num_code; i++) {
+		if (code[i].name == main_name) {
+			main_found = true;
+			break;
+		}
+	}
+	if (!main_found) {
+		error("main function is not found");
+	}
+
+	if (!emit_object && !interp) {
+		out_str(".intel_syntax noprefix\n");
+	}
+
+	if (stats_format != STATS_NONE) {
+		func_insns = calloc(num_code, sizeof(int));
+	}
+	int hits[NUM_PEEPHOLE_RULES + 1] = {0};
+	phase_start(PH_GEN);
+	if (interp) {
+		lower_program();
+	} else {
+		gen_code(hits);
+		if (!emit_object) {
+			// Tell the linker that the stack needn't be executable, like .note.GNU-stack of -c.
+			out_str(".section .note.GNU-stack,\"\",@progbits\n");
+		} else if (!run_jit) {
+			write_object();
+		}
+	}
+	phase_end(PH_GEN);
+
+	int status = 0;
+	if (interp) {
+		status = interpret();
+	} else if (run_jit) {
+		status = run_program();
+		out_len = 0;
+	}
+
+	size_t output_bytes = out_len;
+	if (out_path) {
+		out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out_fd < 0) {
+			error("cannot open %s: %s", out_path, strerror(errno));
+		}
+	}
+	phase_start(PH_EMIT);
+	out_flush();
+	phase_end(PH_EMIT);
+
+	if (opt_info && peephole_window > 0) {
+		print_peephole_hits(hits);
+	}
+	if (mem_report) {
+		fprintf(stderr, "tokens: %d tokens, %zu bytes high-water\n", tokens.len, tokens.high_water);
+		fprintf(stderr, "nodes: %d nodes, %d list entries, %zu bytes reserved\n", num_nodes - 1, num_node_lists,
+				cap_nodes * sizeof(Node) + cap_node_lists * sizeof(NodeId));
+		print_arena_stats(&symbol_arena);
+	}
+	if (stats_format != STATS_NONE) {
+		print_stats(num_tokens, parsed_nodes, output_bytes);
+	}
 	
-	return 0;
+	return status;
 }
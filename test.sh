@@ -3,21 +3,75 @@ assert() {
 	expected="$1"
 	input="$2"
 
-	./n9cc "$input" > tmp.s
-	cc -o tmp tmp.s helper.c
-	./tmp
-	actual="$?"
+	# With -c, n9cc writes an object instead of the assembly, and with --run or --interp it
+	# runs the program itself.
+	case " $flags " in
+	*" --run "* | *" --interp "*)
+		echo "$input" | ./n9cc $flags -
+		actual="$?"
+		;;
+	*)
+		out=tmp.s
+		case " $flags " in *" -c "*) out=tmp.o ;; esac
+		echo "$input" | ./n9cc $flags - > $out
+		cc -o tmp $out helper.c
+		./tmp
+		actual="$?"
+		;;
+	esac
 
 	if [ "$actual" = "$expected" ]; then
-		echo "$input => $actual"
+		echo "[$flags] $input => $actual"
 	else
-		echo "$input => $expected expected, but got $actual"
+		echo "[$flags] $input => $expected expected, but got $actual"
 		exit 1
 	fi
 }
 
-cc -o n9cc main.c
+# tree prints a balanced expression tree of the given depth over the variables a and b.
+# The operators are picked by the level, dividing only at the bottom level.
+tree() {
+	local depth="$1"
+	local ops=("/" "+" "*" "-" "+" "-")
+	if [ "$depth" = 0 ]; then
+		echo "a"
+		return
+	fi
+	if [ "$depth" = 1 ]; then
+		echo "(a/b)"
+		return
+	fi
+	local sub
+	sub="$(tree $((depth - 1)))"
+	echo "($sub${ops[$((depth % 6))]}b*$sub)"
+}
 
+# assert_expr checks an expression over a and b against the value computed by bash.
+assert_expr() {
+	local a=7
+	local b=3
+	local expr="$1"
+	assert $(( ($expr) & 255 )) "int main(){int a; int b; a=$a; b=$b; return $expr;}"
+}
+
+# assert_report checks a line reported to stderr, e.g. by -fopt-info.
+assert_report() {
+	opts="$1"
+	expected="$2"
+	input="$3"
+
+	actual="$(echo "$input" | ./n9cc $opts - 2>&1 >/dev/null)"
+	if echo "$actual" | grep -qF "$expected"; then
+		echo "[$opts] $input => $expected"
+	else
+		echo "[$opts] $input => $expected expected, but got $actual"
+		exit 1
+	fi
+}
+
+cc -o n9cc main.c helper.c
+
+run_tests() {
 assert 0 "int main(){return 0;}"
 assert 255 "int main(){255;}"
 assert 42 "int main(){42;}"
@@ -94,6 +148,13 @@ assert 1 "int main(){0; return 1;}"
 assert 10 "int main(){int a; a=0; while(1) {if (a >= 10) return a; a = a + 1;}}"
 assert 10 "int main(){int i; for (i=0; i < 10; i = i + 1) {} return i;}"
 
+assert 3 "int main(){int int1; int iffy; int1=1; iffy=2; return int1+iffy;}"
+assert 7 "int main(){int returned; int elsewhere; int breakfast; int whilst; int format; returned=1; elsewhere=1; breakfast=2; whilst=1; format=2; return returned+elsewhere+breakfast+whilst+format;}"
+
+assert 1 "int main(){int a; a=1; {int a; a=2;} return a;}"
+assert 12 "int main(){int a; a=1; {int b; b=a+1; a=b; {int a; a=5;}} {int b; b=10; a=a+b;} return a;}"
+assert 3 "int f(int a){{int a; a=2;} return a;} int main(){int a; a=1; return f(3);}"
+
 assert 42 "int main(){ret42();}"
 assert 42 "int main(){id(42);}"
 assert 42 "int main(){add2(41, 1);}"
@@ -114,4 +175,158 @@ assert 42 "int main(){int a; int *b; int **c; b=&a; c=&b; **c=42; return a;}"
 assert 42 "int assign(int *var, int n){return *var=n;} int main(){int a; assign(&a, 42); return a;}"
 assert 42 "int assign(int **var, int n){return **var=n;} int main(){int a; int b; b=&a; assign(&b, 42); return a;}"
 
+assert 55 "int main(){return 1+(2+(3+(4+(5+(6+(7+(8+(9+10))))))));}"
+assert_expr "a*b-(a/b)*(a-b)+(a/b)*(a/b)*(b/b)-4"
+assert 13 "int main(){int a; int b; a=7; b=3; return (a-b)/(b-a*a) + add2(a,b*2);}"
+assert 23 "int main(){int a; int b; a=7; b=3; return a + add3(a*b, add2(1, 2), a - b) - add2(a, b) * (b - 2) - 2;}"
+assert 42 "int main(){int a; int b; int c; int d; int e; int f; int g; a=1; b=2; c=3; d=4; e=5; f=6; g=7; for (a=0; a<3; a=a+1) {b=b+a; c=c+b; d=d+c; e=e+d; f=f+e; g=g+f;} return a+b+c+d+e+f+g-372;}"
+assert 42 "int main(){int i; int s; int *p; s=0; p=&s; for (i=0; i<7; i=i+1) *p = *p + i; return s*2;}"
+assert 42 "int inc(int *p){*p = *p + 1; return 0;} int main(){int i; int j; j=0; for (i=0; i<42; i=i+1) inc(&j); return j;}"
+assert 42 "int sum(int n){int i; int s; s=0; for (i=1; i<=n; i=i+1) s=s+i; return s;} int main(){int i; int s; s=0; for (i=0; i<3; i=i+1) s=s+sum(i+3); return s+11;}"
+assert 42 "int f(int a, int b, int c, int d, int e, int f){a=a+1; return a+b+c+d+e+f;} int main(){int a; a=5; return f(a, 6, 7, 8, a, a) + a;}"
+assert 5 "int main(){int a; a=0; add2(a=5, 0)*0; return a;}"
+assert 7 "int main(){int a; a=7; return 0-(0-a) + a*0 + 0*a + a*1 - 1*a + a/1 - a + 0;}"
+assert 3 "int main(){if (2*3-6) return 4; else if (1) return 3; return 2;}"
+assert 9 "int main(){int a; a=9; while (3-3) a=0; for (a=a; 1-1; ) a=0; return a;}"
+assert 10 "int main(){int a; a=0; while (2) {a=a+1; if (a == 10) break;} return a;}"
+assert 10 "int main(){int a; for (a=0; 1; a=a+1) if (a == 10) break; return a;}"
+assert_expr "$(tree 4)"
+assert_expr "$(tree 9)"
+assert_expr "a-$(tree 8)"
+assert_expr "$(tree 8)/(b-$(tree 7))"
+assert_expr "(((a+b)*(a-b))/((a*b)-(a/b)))*(((a+b)-(a-b))/((a*b)/(a+b))) + (a-b) - 1"
+# Multiplications and divisions by constants, some deep enough for rdx to hold a temporary.
+assert_expr "a*45+b*-24+a*-1+b*0+a*1+40*b+a*1024"
+assert_expr "a/2+(0-a)/2+a/-4+(0-a*99)/8+a*1000/-7+b/1-b/-1"
+assert_expr "((a*b)+(a-b))*(((a+b)*(a-b))-(b*(a/7)+b/5))"
+assert_expr "(((a*b)+(a-b))*((a+b)*(a-b)))-((((a+b)*(a-b))-((a+b)*(a+b)))*(((a+b)*(a-b))+((a*100/7)*(a*100/-7))))"
+
+# Conditions branch on comparisons directly, including comparisons of comparisons with 0 or 1.
+assert 42 "int main(){int a; a=3; if ((a < 5) == 0) return 1; if (0 == (a <= 2)) return 42; return 2;}"
+assert 42 "int main(){int a; a=3; if ((a == 3) != 1) return 1; if (1 != (a != 3)) return 42; return 2;}"
+assert 42 "int main(){int a; int b; a=3; b=4; if (5 < a) return 1; if (3 <= a) if (b <= a) return 2; else return 42; return 3;}"
+assert 10 "int main(){int i; int *p; p=&i; i=0; while (i < 10) i=i+1; return *p;}"
+assert 42 "int main(){int a; int b; a=40; for (b=0; a+b < a*1+2; b=b+1) 0; return a+b;}"
+assert 2 "int main(){int a; a=3; if ((a < 5) == 2) return 1; return 2;}"
+
+# Rotated loops test the condition before the first iteration and at the bottom.
+assert 0 "int main(){int i; int n; n=0; for (i=5; i<5; i=i+1) n=n+1; while (n > 0) n=n-1; return n;}"
+assert 42 "int main(){int i; int n; n=0; for (i=0; i<100; i=i+1) { if (i == 42) break; n=n+1; } return n;}"
+assert 42 "int main(){int i; i=0; for (;;) { i=i+1; if (i == 42) break; } return i;}"
+assert 42 "int main(){int i; int j; int n; n=0; i=0; while (i < 6) { for (j=0; j<10; j=j+1) { if (j == 7) break; n=n+1; } i=i+1; } return n;}"
+assert 45 "int count(int *p){*p = *p + 1; return *p;} int main(){int c; int s; c=0; s=0; while (count(&c) < 10) s=s+c; return s;}"
+
+# The tokenizer scans runs of spaces, letters and digits longer than its vectors.
+assert 42 "int main(){int theNameOfThisVariableIsLongerThanThirtyTwoBytes;                                  theNameOfThisVariableIsLongerThanThirtyTwoBytes = 0000000000000000000000000000000000000042;
+	return theNameOfThisVariableIsLongerThanThirtyTwoBytes;}"
+# A literal too large for long stops at LONG_MAX, as with strtol, and is truncated to int.
+assert 255 "int main(){return 99999999999999999999;}"
+}
+
+assert_report "-O1 -fopt-info" "fold: eliminated 4 nodes" "int main(){return 5*(9-6);}"
+assert_report "-O1 -fopt-info" "fold: eliminated 9 nodes" "int main(){int a; a=1; if (0) a=2; return a*1+0;}"
+assert_report "-O0 -fpeephole-window=2 -fopt-info" "peephole: push-pop-same: 6 hits" "int main(){int a; a=3; if (a < 5) return 2; return a;}"
+assert_report "-O0 -fpeephole-window=2 -fopt-info" "peephole: setcc-branch: 0 hits" "int main(){int a; a=3; if (a < 5) return 2; return a;}"
+assert_report "-O0 -fpeephole-window=4 -fopt-info" "peephole: setcc-branch: 1 hits" "int main(){int a; a=3; if (a < 5) return 2; return a;}"
+# -O1 branches on the comparison itself, leaving nothing for the setcc rules.
+assert_report "-O1 -fopt-info" "peephole: setcc-mov-branch: 0 hits" "int main(){int a; a=3; if (a < 5) return 2; return a;}"
+assert_report "-O1 -fopt-info" "peephole: jcc-over-jmp: 1 hits" "int main(){int i; for (i=0; i<10; i=i+1) if (i == 5) break; return i;}"
+assert_report "-fmem-report" "arena symbol: 40 bytes used, 40 bytes high-water" "int main(){int a; a=1; return a;}"
+assert_report "-fmem-report" "tokens: 17 tokens, " "int main(){int a; a=1; return a;}"
+assert_report "--stats" "stats: tokens: 17" "int main(){int a; a=1; return a;}"
+assert_report "-O1 --stats" "stats: instructions: 19, 19.0 per function, at most 19 in main" "int main(){int a; a=1; return a;}"
+assert_report "-O1 --stats" "stats: function f: 10 instructions" "int f(){return 1;} int main(){return f();}"
+assert_report "--stats=json" '"tokens": 17, "nodes": 7,' "int main(){int a; a=1; return a;}"
+assert_report "-O0" "<stdin>:1:20: use of undefined variable: b" "int main(){ return b; }"
+assert_report "-O0" "<stdin>:2:10: expected a number" "int main(){
+  return ;}"
+assert_report "-O0" "main function is not found" "int mainx(){ return 0; }"
+
+# The source can also be read from a file.
+echo "int main(){return 42;}" > tmp.c
+./n9cc tmp.c > tmp.s && cc -o tmp tmp.s && { ./tmp; [ $? = 42 ]; } || { echo "reading tmp.c failed"; exit 1; }
+echo "tmp.c => 42"
+
+# -j generates functions in parallel, but the assembly must not change.
+for i in $(seq 50); do echo "int f$i(int x){ if (x) return f$i(x-1)+$i; return 0; }"; done > tmp.c
+echo "int main(){ return f50(2); }" >> tmp.c
+./n9cc -O1 tmp.c > tmp.s
+./n9cc -O1 -j 4 tmp.c | cmp -s - tmp.s || { echo "-j 4 changed the assembly"; exit 1; }
+echo "tmp.c -j 4 => same assembly"
+./n9cc -O1 -c tmp.c > tmp.o
+./n9cc -O1 -c -j 4 tmp.c | cmp -s - tmp.o || { echo "-j 4 changed the object"; exit 1; }
+echo "tmp.c -c -j 4 => same object"
+# -j larger than the number of functions starts only one thread per function.
+echo "int f(){ return 40; } int main(){ return f()+2; }" > tmp.c
+./n9cc -O1 tmp.c > tmp.s
+./n9cc -O1 -j 100000 tmp.c | cmp -s - tmp.s || { echo "-j 100000 changed the assembly"; exit 1; }
+echo "tmp.c -j 100000 => same assembly"
+
+# -O1 reduces multiplications and divisions by constants to shifts, leas and multiplications
+# by magic numbers. Check them against cc over many constants and dividends. show records the
+# values, which are printed at exit because n9cc doesn't align the stack for printf.
+consts="$(seq -130 130) 255 256 257 641 1000 1023 1024 1025 4096 65535 65536 65537 1000000 1000003
+ 2147483647 -2147483647 -255 -256 -1000 -1024 -65536 -1000003"
+n=0
+for c in $consts; do
+	div="x/$c"
+	[ $c = 0 ] && div="0"
+	echo "int mul$n(int x){return x*$c;} int lmul$n(int x){return $c*x;} int div$n(int x){return $div;}"
+	n=$((n + 1))
+done > tmp.c
+echo "int t(int x){" >> tmp.c
+for i in $(seq 0 $((n - 1))); do echo "show(mul$i(x)); show(lmul$i(x)); show(div$i(x));"; done >> tmp.c
+echo "return 0;}" >> tmp.c
+echo "int main(){int b; b=2147483647; t(0); t(1); t(-1); t(2); t(-2); t(7); t(-7); t(99); t(-99); t(100); t(-100);
+ t(12345678); t(-12345678); t(b); t(-b); t(-b-1); t(b*b); t(-b*b); t(b*b*2+b*2+1); t(-b*b*2-b*2-1); return 0;}" >> tmp.c
+echo '#include <stdio.h>
+long vals[1 << 16];
+int num_vals;
+long show(long v) { vals[num_vals++] = v; return 0; }
+__attribute__((destructor)) void print_vals() { for (int i = 0; i < num_vals; i++) printf("%ld\n", vals[i]); }' > tmp_show.c
+cc -c -o tmp_show.o tmp_show.c && cc -std=gnu89 -w -Dint=long -o tmp tmp.c tmp_show.o && ./tmp > tmp.expected || { echo "cc failed"; exit 1; }
+for out in tmp.s tmp.o; do
+	opts="-O1"
+	[ $out = tmp.o ] && opts="-O1 -c"
+	./n9cc $opts tmp.c > $out && cc -o tmp $out tmp_show.o && ./tmp | cmp -s - tmp.expected ||
+		{ echo "[$opts] multiplications and divisions by constants differ from cc"; exit 1; }
+	echo "[$opts] $n constants => same as cc"
+done
+
+# Each implementation of the scans of the tokenizer must make the same tokens.
+for lexer in scalar sse2 avx2; do
+	./n9cc -O1 -flexer=$lexer tmp.c | cmp -s - tmp.s || { echo "-flexer=$lexer changed the assembly"; exit 1; }
+	echo "tmp.c -flexer=$lexer => same assembly"
+done
+for lexer in scalar sse2 avx2; do
+	flags="-O0 -flexer=$lexer"
+	assert 255 "int main(){return 99999999999999999999;}"
+	assert 42 "int main(){return 0000000000000000000000000000000000000042;}"
+done
+
+flags="-O0"
+run_tests
+flags="-O0 -fpeephole-window=5 --no-annotate"
+run_tests
+flags="-O1"
+run_tests
+flags="-O1 -j 3"
+run_tests
+flags="-O0 -floop-rotate"
+run_tests
+flags="-O1 -fno-loop-rotate"
+run_tests
+flags="-O0 -c"
+run_tests
+flags="-O1 -c -j 3"
+run_tests
+flags="-O0 --run"
+run_tests
+flags="-O1 --run"
+run_tests
+flags="-O0 --interp"
+run_tests
+flags="-O1 --interp"
+run_tests
+
 echo OK
@@ -0,0 +1,88 @@
+// stress compiles programs of many small functions and checks that the time and the memory
+// it takes grow linearly with the number of functions. Each compilation runs in a child process
+// so that it starts from a clean state and its peak memory can be measured.
+//
+//   make stress
+#define _DEFAULT_SOURCE
+#define main n9cc_main
+#include "../main.c"
+#undef main
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+// gen_program generates a program of n functions, each of which calls the previous one.
+char *gen_program(int n) {
+	size_t cap = (size_t)n * 160 + 256;
+	char *buf = malloc(cap);
+	size_t len = 0;
+	len += sprintf(buf + len, "int f0(int a, int b) { return a + b; }\n");
+	for (int i = 1; i < n; i++) {
+		len += sprintf(buf + len,
+					   "int f%d(int a, int b) { int c; c = a * %d + b; if (c > 100) return c - f%d(a, b); return c; }\n",
+					   i, i % 97, i - 1);
+	}
+	sprintf(buf + len, "int main() { return f%d(1, 2); }\n", n - 1);
+	return buf;
+}
+
+// compile compiles a program of n functions in a child process and returns its CPU time in
+// seconds and its peak memory in KiB.
+void compile(int n, char *opt, double *seconds, long *max_rss) {
+	char *src = gen_program(n);
+	char path[] = "/tmp/n9cc-stress-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0 || write(fd, src, strlen(src)) != (ssize_t)strlen(src)) {
+		fprintf(stderr, "stress: cannot write %s\n", path);
+		exit(1);
+	}
+	close(fd);
+	free(src);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		int devnull = open("/dev/null", O_WRONLY);
+		dup2(devnull, STDOUT_FILENO);
+		char *argv[] = {"n9cc", opt, path, NULL};
+		exit(n9cc_main(3, argv));
+	}
+
+	int status;
+	struct rusage usage;
+	wait4(pid, &status, 0, &usage);
+	unlink(path);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "stress: compiling %d functions failed\n", n);
+		exit(1);
+	}
+	*seconds = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+		+ (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+	*max_rss = usage.ru_maxrss;
+}
+
+int main() {
+	char *opts[] = {"-O0", "-O1"};
+	int small = 25000;
+	int large = 100000;
+	bool ok = true;
+
+	for (int i = 0; i < 2; i++) {
+		double small_time, large_time;
+		long small_rss, large_rss;
+		compile(small, opts[i], &small_time, &small_rss);
+		compile(large, opts[i], &large_time, &large_rss);
+
+		// Growing 4x should take about 4x; quadratic behavior would take 16x.
+		// The ratios allow for noise and the constant cost of a process.
+		double time_ratio = large_time / (small_time > 0.01 ? small_time : 0.01);
+		double rss_ratio = (double)large_rss / small_rss;
+		bool linear = time_ratio < 8 && rss_ratio < 6;
+		printf("[%s] %d functions: %.3f s, %ld KiB; %d functions: %.3f s, %ld KiB => %s\n",
+			   opts[i], small, small_time, small_rss, large, large_time, large_rss,
+			   linear ? "linear" : "NOT linear");
+		ok = ok && linear;
+	}
+	return ok ? 0 : 1;
+}